@@ -5,6 +5,111 @@
 
 #include "ndlcom/Node.h"
 #include "ndlcom/NodeHandler.h"
+#include "representations/Isp.h"
+
+/*
+ * Compile time configuration.
+ * Small bootloaders can provide their own settings in a header given by
+ * ISP_CONFIG_HEADER, e.g. -DISP_CONFIG_HEADER=\"isp_config.h\"
+ * A library built by cmake with ISP_CONFIG_HEADER installs it as isp/config.h,
+ * which is used when ISP_HAVE_CONFIG_H is defined (see isp.pc).
+ * The block size is fixed by ISP_DATA_TRANSMISSION_BLOCK_SIZE of the IspData representation.
+ */
+#if defined(ISP_CONFIG_HEADER)
+#include ISP_CONFIG_HEADER
+#elif defined(ISP_HAVE_CONFIG_H)
+#include "isp/config.h"
+#endif
+
+/*Build the master functions (not needed in a bootloader)*/
+#ifndef ISP_ENABLE_MASTER
+#define ISP_ENABLE_MASTER 1
+#endif
+
+/*Answer download/verify requests as a slave*/
+#ifndef ISP_ENABLE_DOWNLOAD
+#define ISP_ENABLE_DOWNLOAD 1
+#endif
+
+/*Let slaves read the next block ahead while answering download requests (costs one block of RAM)*/
+#ifndef ISP_ENABLE_PREFETCH
+#define ISP_ENABLE_PREFETCH 0
+#endif
+#if ISP_ENABLE_PREFETCH && !ISP_ENABLE_DOWNLOAD
+#error "ISP_ENABLE_PREFETCH needs ISP_ENABLE_DOWNLOAD"
+#endif
+
+/*Support pacing of outgoing packets (see ispRateLimiter)*/
+#ifndef ISP_ENABLE_RATE_LIMIT
+#define ISP_ENABLE_RATE_LIMIT 1
+#endif
+
+/*Packets a paced context holds back before refusing further ones (each costs one packet in its ispPacketQueue)*/
+#ifndef ISP_RATE_LIMIT_QUEUE
+#define ISP_RATE_LIMIT_QUEUE 2
+#endif
+
+/*
+ * Number of blocks which may be in flight during an upload. Masters keep unacknowledged
+ * blocks and slaves keep blocks received out of order, each costing one block of RAM.
+ * 1 (the default) removes the window support and leaves plain stop-and-wait. At most 32.
+ */
+#ifndef ISP_WINDOW_SIZE
+#define ISP_WINDOW_SIZE 1
+#endif
+#if ISP_WINDOW_SIZE < 1 || ISP_WINDOW_SIZE > 32
+#error "ISP_WINDOW_SIZE has to be within 1..32"
+#endif
+#if ISP_WINDOW_SIZE > 1 && ISP_ENABLE_RATE_LIMIT && ISP_RATE_LIMIT_QUEUE < 2
+#error "Windowed uploads need ISP_RATE_LIMIT_QUEUE of at least 2, the offer goes out together with the upload"
+#endif
+
+/*A slave acknowledges at most every ISP_ACK_EVERY blocks, but at least twice per window*/
+#ifndef ISP_ACK_EVERY
+#define ISP_ACK_EVERY 4
+#endif
+
+/*Microseconds a slave holds back an acknowledgement (only if a clock is given)*/
+#ifndef ISP_ACK_DELAY
+#define ISP_ACK_DELAY 2000
+#endif
+
+/*Microseconds without progress after which a master resends its oldest block (only if a clock is given)*/
+#ifndef ISP_RESEND_TIMEOUT
+#define ISP_RESEND_TIMEOUT 50000
+#endif
+
+/*Reports of the same gap after which a master resends it, a single one is most likely reordering*/
+#ifndef ISP_SACK_THRESHOLD
+#define ISP_SACK_THRESHOLD 2
+#endif
+
+/*
+ * Commands in addition to the ones of the IspCommand representation. Peers not knowing
+ * them ignore them, which keeps uploads working in stop-and-wait mode.
+ * WINDOW: offers up to mLength blocks in flight for the UPLOAD of mAddress which follows
+ *   right behind. A slave taking the offer answers the UPLOAD with an ACK carrying the
+ *   agreed window in mLength, instead of the length of the region.
+ * SACK: everything before mAddress has arrived, mAddress..mAddress+mLength is missing
+ *   and the block right behind it has arrived
+ */
+#define ISP_CMD_WINDOW 0x80
+#define ISP_CMD_SACK   0x81
+
+/*
+ * Static slave callbacks: when ISP_SLAVE_WRITE (and ISP_SLAVE_READ, ISP_SLAVE_EXEC as needed)
+ * name functions or macros with the signatures of ispWriteFunc etc., the slave calls them
+ * directly instead of through ispContext, so the compiler can inline them.
+ * Without ISP_SLAVE_EXEC the execute command is ignored.
+ */
+#if defined(ISP_SLAVE_WRITE)
+#define ISP_STATIC_CALLBACKS 1
+#if ISP_ENABLE_MASTER
+#error "Static slave callbacks cannot be used together with ISP_ENABLE_MASTER"
+#endif
+#else
+#define ISP_STATIC_CALLBACKS 0
+#endif
 
 #if defined(__cplusplus)
 extern "C" {
@@ -25,6 +130,10 @@ typedef enum {
 /**
  * For the ISP master these functions provide access to the image files
  * For the ISP slave these functions provide access to the PROM/Flash memory
+ * at startAddr + offset of the context.
+ * Slaves only read what a master asked for, except when a prefetch limit is set
+ * (see ispSlaveSetPrefetchLimit): then the block following each download request
+ * is read ahead as well, as long as it starts below the limit.
  * Signature: (contextPtr, bufferPtr, size)
  */
 typedef unsigned int (*ispReadFunc)(void *,void *, const unsigned int);
@@ -37,6 +146,44 @@ typedef void (*ispWriteFunc)(void *,const void *, const unsigned int);
  */
 typedef void (*ispExecFunc)(void *);
 
+/**
+ * Monotonic time source in microseconds, used for pacing and delayed acknowledgements
+ */
+typedef unsigned long (*ispClockFunc)(void);
+
+#if ISP_ENABLE_RATE_LIMIT
+/**
+ * Token bucket limiting the bandwidth of all ISP packets sent on a node.
+ * One limiter is meant to be shared by all contexts registered on the same node,
+ * so that parallel transfers only use the capacity left by other traffic.
+ * Tokens are bytes; the bucket may go into debt by at most one packet.
+ * Packets exceeding the budget are held back in the queue of their context and sent
+ * by ispProcess(). Packets beyond that are refused; the protocol recovers from them
+ * like from packets lost on the bus.
+ */
+typedef struct {
+    ispClockFunc clock;
+    unsigned long rate;
+    long burst;
+    long tokens;
+    unsigned long lastTick;
+} ispRateLimiter;
+
+/**
+ * Packets of one paced context held back by its rate limiter, oldest first.
+ * Kept outside of ispContext, so only paced contexts pay for it.
+ */
+typedef struct {
+    unsigned int first;
+    unsigned int count;
+    unsigned int size[ISP_RATE_LIMIT_QUEUE];
+    union {
+        struct IspCommand cmd;
+        struct IspData data;
+    } packets[ISP_RATE_LIMIT_QUEUE];
+} ispPacketQueue;
+#endif
+
 /**
  * The ispContext contains all information needed for the ISP functionality
  */
@@ -51,9 +198,47 @@ typedef struct {
     unsigned int startAddr;
     unsigned int offset;
     unsigned int length;
+#if !ISP_STATIC_CALLBACKS
     ispReadFunc read;
     ispWriteFunc write;
     ispExecFunc exec;
+#endif
+#if ISP_WINDOW_SIZE > 1
+    /*Upload window (negotiated per upload)*/
+    unsigned char master;
+    unsigned int window;
+    /*Master: configured window, bytes sent (offset counts the acknowledged ones)*/
+    unsigned int maxWindow;
+    unsigned int sent;
+    /*Master: range still to be resent, and how often the gap at sackAddr has been reported*/
+    unsigned int resendPos;
+    unsigned int resendEnd;
+    unsigned int sacks;
+    uint32_t sackAddr;
+    /*Slave: window offered for the next upload (0 if none), by whom and for which address*/
+    unsigned int offer;
+    uint32_t offerAddr;
+    NDLComId offerId;
+    /*Slave: bitmap of buffered window slots and blocks written since the last ACK*/
+    uint32_t received;
+    unsigned int unacked;
+    /*Slave: time of the oldest unacknowledged block, master: time of the last progress*/
+    unsigned long ackTime;
+    ispClockFunc clock;
+    uint8_t windowData[ISP_WINDOW_SIZE][ISP_DATA_TRANSMISSION_BLOCK_SIZE];
+#endif
+#if ISP_ENABLE_PREFETCH
+    /*Slave read ahead for sequential downloads, never at or beyond prefetchEnd*/
+    unsigned int prefetchEnd;
+    unsigned int prefetchAddr;
+    unsigned int prefetchLength;
+    uint8_t prefetch[ISP_DATA_TRANSMISSION_BLOCK_SIZE];
+#endif
+#if ISP_ENABLE_RATE_LIMIT
+    /*Pacing stuff: the shared bucket and the packets it held back (both NULL if not paced)*/
+    ispRateLimiter *limiter;
+    ispPacketQueue *pending;
+#endif
 } ispContext;
 
 
@@ -63,19 +248,62 @@ typedef struct {
 int ispIsBusy(ispContext *ctx);
 
 /**
- * Destroys a given context
+ * Destroys a given context and deregisters its handler from the node
  */
 void ispDestroy(ispContext *ctx);
 
+#if ISP_ENABLE_RATE_LIMIT
+/**
+ * Initializes a token bucket with the given rate (bytes/s) and burst (bytes).
+ * The burst is at least one packet, as smaller buckets would never let one go.
+ */
+void ispRateLimiterInit(ispRateLimiter *limiter, ispClockFunc clockFunc, const unsigned long rate, const unsigned long burst);
+
+/**
+ * Attaches a (shared) token bucket to the given context, together with the queue for
+ * the packets it holds back. The queue belongs to this context alone and has to live
+ * as long as it is attached. Passing NULL for either disables pacing.
+ */
+void ispSetRateLimiter(ispContext *ctx, ispRateLimiter *limiter, ispPacketQueue *queue);
+#endif
+
+/**
+ * Sends packets which have been held back by the rate limiter or a delayed acknowledgement.
+ * Has to be called periodically (e.g. in the main loop) when a rate limiter or clock is used.
+ */
+void ispProcess(ispContext *ctx);
+
+#if ISP_WINDOW_SIZE > 1
+/**
+ * Gives a context a clock for windowed uploads. Slaves hold back acknowledgements for up
+ * to ISP_ACK_DELAY while waiting for more blocks, masters resend the oldest block after
+ * ISP_RESEND_TIMEOUT without progress. Without a clock, acknowledgements are only
+ * coalesced as long as the master keeps enough blocks in flight.
+ */
+void ispSetClock(ispContext *ctx, ispClockFunc clockFunc);
+#endif
+
 /* SLAVE FUNCTIONS*/
 
 /**
  * This function creates a context for an ISP slave
+ * With static slave callbacks the function pointers are ignored and may be NULL
  */
 void ispSlaveCreate(ispContext *ctx, struct NDLComNode *node, ispReadFunc readFunc, ispWriteFunc writeFunc, ispExecFunc execFunc);
 
+#if ISP_ENABLE_PREFETCH
+/**
+ * Lets the slave read the next block ahead while answering downloads, so sequential
+ * downloads are answered from RAM. Only memory below endAddr (exclusive) is read
+ * speculatively, e.g. the end of the flash. 0 (the default) disables reading ahead.
+ */
+void ispSlaveSetPrefetchLimit(ispContext *ctx, const unsigned int endAddr);
+#endif
+
 /* MASTER FUNCTIONS*/
 
+#if ISP_ENABLE_MASTER
+
 /**
  * This function creates a context for an ISP master
  */
@@ -84,6 +312,16 @@ void ispMasterCreate(ispContext *ctx, struct NDLComNode *node, ispReadFunc readF
  * Sets the target id and region information for the upcoming isp operation
  */
 void ispMasterSetTarget(ispContext *ctx, const NDLComId targetId, const unsigned int addr, const unsigned int len);
+#if ISP_WINDOW_SIZE > 1
+/**
+ * Sets the number of blocks sent ahead during uploads (1..ISP_WINDOW_SIZE, default 1).
+ * The window is agreed on with the UPLOAD command, slaves without window support simply
+ * stay with stop-and-wait. Slaves acknowledge cumulatively and report gaps, gaps reported
+ * ISP_SACK_THRESHOLD times are resent. Gaps which are not reported often enough (e.g. at
+ * the end of the region) are only recovered with a clock (see ispSetClock).
+ */
+void ispMasterSetWindow(ispContext *ctx, const unsigned int blocks);
+#endif
 /**
  * Starts the upload of the content returned by read to the target device's PROM
  */
@@ -97,10 +335,17 @@ void ispMasterStartDownload(ispContext *ctx);
  */
 void ispMasterStartVerify(ispContext *ctx);
 
+/**
+ * Gives up on the running operation: held back packets are dropped, the target is told
+ * to return to idle and the context goes into the error state.
+ */
+void ispMasterAbort(ispContext *ctx);
+
 /* UGLY MASTER FUNCTIONS */
 
 void ispMasterExecuteSlaveBootloader (ispContext *ctx);
 void ispMasterExecuteSlaveFirmware (ispContext *ctx);
+#endif
 
 #if defined(__cplusplus)
 }
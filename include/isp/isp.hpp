@@ -0,0 +1,456 @@
+#ifndef __ISP_HPP
+#define __ISP_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "ndlcom/Bridge.h"
+#include "isp/isp.h"
+
+#if !ISP_ENABLE_MASTER || !ISP_ENABLE_RATE_LIMIT
+#error "The C++ layer needs ISP_ENABLE_MASTER and ISP_ENABLE_RATE_LIMIT"
+#endif
+
+namespace isp {
+
+/**
+ * A region of PROM/Flash content. Images are move-only, so large buffers are
+ * handed over to an operation instead of being copied.
+ */
+class Image {
+public:
+    Image() : mAddress(0) {}
+    Image(const unsigned int address, std::vector<uint8_t> data)
+        : mAddress(address), mData(std::move(data)) {}
+
+    Image(Image &&other) = default;
+    Image &operator=(Image &&other) = default;
+    Image(const Image &other) = delete;
+    Image &operator=(const Image &other) = delete;
+
+    unsigned int address() const { return mAddress; }
+    unsigned int size() const { return mData.size(); }
+    const uint8_t *data() const { return mData.data(); }
+    std::vector<uint8_t> &bytes() { return mData; }
+
+private:
+    unsigned int mAddress;
+    std::vector<uint8_t> mData;
+};
+
+/**
+ * Outcome of an operation. For downloads, image carries the received content.
+ */
+struct Result {
+    ispState state;
+    /*Address at which the operation stopped (first mismatch when verifying)*/
+    unsigned int address;
+    Image image;
+
+    bool ok() const { return state == ISP_STATE_IDLE; }
+};
+
+typedef std::function<void(Result)> Completion;
+
+/*Takes the content of a streamed download piece by piece, in order*/
+typedef std::function<void(const uint8_t *data, const unsigned int length)> Sink;
+
+/*Provides the content of a streamed upload: fills up to length bytes and returns how many*/
+typedef std::function<unsigned int(uint8_t *buffer, const unsigned int length)> Source;
+
+class Session;
+
+/**
+ * Drives the bridge and all sessions attached to it from one thread.
+ * Any number of operations can be in flight without extra threads: every
+ * session advances its own queue when polled.
+ */
+class Executor {
+public:
+    explicit Executor(struct NDLComBridge &bridge) : mBridge(bridge) {}
+
+    Executor(const Executor &other) = delete;
+    Executor &operator=(const Executor &other) = delete;
+
+    /**
+     * Processes the bridge once and advances all sessions.
+     * Returns true as long as any session has work left.
+     */
+    inline bool runOnce();
+
+    /**
+     * Runs until all sessions are idle
+     */
+    void run() { while (runOnce()) {} }
+
+private:
+    friend class Session;
+
+    void attach(Session *session) { mSessions.push_back(session); }
+    void detach(Session *session)
+    {
+        mSessions.erase(std::remove(mSessions.begin(), mSessions.end(), session), mSessions.end());
+    }
+
+    struct NDLComBridge &mBridge;
+    std::vector<Session *> mSessions;
+};
+
+/**
+ * An ISP master talking to one target. The underlying ispContext is created
+ * on construction and destroyed (including handler deregistration) on destruction.
+ * Operations are queued and executed one after another; they may be submitted
+ * from any thread but only complete on the executor's thread.
+ * Without a timeout, an operation waits forever for a target which does not answer.
+ */
+class Session {
+public:
+    Session(Executor &executor, struct NDLComNode &node, const NDLComId targetId, ispRateLimiter *limiter = NULL)
+        : mExecutor(executor), mTargetId(targetId), mTimeout(0), mActive(false), mCursor(0),
+          mLastState(ISP_STATE_IDLE), mLastOffset(0)
+    {
+        mContext.self = this;
+        ispMasterCreate(&mContext.ctx, &node, read, write);
+        ispSetRateLimiter(&mContext.ctx, limiter, &mPending);
+        mExecutor.attach(this);
+    }
+
+    ~Session()
+    {
+        std::deque<Operation> queue;
+
+        mExecutor.detach(this);
+        ispDestroy(&mContext.ctx);
+        /*Nobody will finish the remaining operations*/
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            queue.swap(mQueue);
+        }
+        if (mActive)
+            queue.push_front(std::move(mCurrent));
+        for (Operation &op : queue)
+            finish(op, ISP_STATE_ERROR, op.address);
+    }
+
+    /*The context is registered at the node, so sessions must stay in place*/
+    Session(const Session &other) = delete;
+    Session &operator=(const Session &other) = delete;
+
+    NDLComId targetId() const { return mTargetId; }
+
+#if ISP_WINDOW_SIZE > 1
+    /**
+     * Number of blocks sent ahead during uploads (see ispMasterSetWindow)
+     */
+    void setWindow(const unsigned int blocks) { ispMasterSetWindow(&mContext.ctx, blocks); }
+#endif
+
+    /**
+     * Aborts operations which make no progress for the given time (zero, the default,
+     * waits forever). They complete with ISP_STATE_ERROR at the address they got stuck.
+     */
+    void setTimeout(const std::chrono::milliseconds timeout) { mTimeout = timeout; }
+
+    void upload(Image image, Completion done) { submit(UPLOAD, std::move(image), 0, 0, std::move(done)); }
+    void download(const unsigned int address, const unsigned int length, Completion done)
+    {
+        submit(DOWNLOAD, Image(), address, length, std::move(done));
+    }
+    void verify(Image image, Completion done) { submit(VERIFY, std::move(image), 0, 0, std::move(done)); }
+
+    /**
+     * Streaming variants for content which should not be kept in memory as a whole.
+     * The source and sink are called on the executor's thread while the operation
+     * runs; the image of a streamed download's result stays empty.
+     */
+    void upload(const unsigned int address, const unsigned int length, Source source, Completion done)
+    {
+        Operation op = operation(UPLOAD, Image(), address, length, std::move(done));
+        op.source = std::move(source);
+        submit(std::move(op));
+    }
+    void download(const unsigned int address, const unsigned int length, Sink sink, Completion done)
+    {
+        Operation op = operation(DOWNLOAD, Image(), address, length, std::move(done));
+        op.sink = std::move(sink);
+        submit(std::move(op));
+    }
+    void verify(const unsigned int address, const unsigned int length, Source source, Completion done)
+    {
+        Operation op = operation(VERIFY, Image(), address, length, std::move(done));
+        op.source = std::move(source);
+        submit(std::move(op));
+    }
+
+    std::future<Result> upload(Image image)
+    {
+        return submit(UPLOAD, std::move(image), 0, 0);
+    }
+    std::future<Result> download(const unsigned int address, const unsigned int length)
+    {
+        return submit(DOWNLOAD, Image(), address, length);
+    }
+    std::future<Result> verify(Image image)
+    {
+        return submit(VERIFY, std::move(image), 0, 0);
+    }
+
+    /**
+     * Lets the target jump into its bootloader or firmware. Completes as soon
+     * as the command has been sent, as there is no answer to wait for.
+     */
+    void execute(const bool bootloader, Completion done)
+    {
+        submit(bootloader ? EXECUTE_BOOTLOADER : EXECUTE_FIRMWARE, Image(), 0, 0, std::move(done));
+    }
+    std::future<Result> execute(const bool bootloader)
+    {
+        return submit(bootloader ? EXECUTE_BOOTLOADER : EXECUTE_FIRMWARE, Image(), 0, 0);
+    }
+
+    /**
+     * True if neither an operation is running nor queued
+     */
+    bool idle()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return !mActive && mQueue.empty();
+    }
+
+private:
+    friend class Executor;
+
+    enum Kind { UPLOAD, DOWNLOAD, VERIFY, EXECUTE_BOOTLOADER, EXECUTE_FIRMWARE };
+
+    struct Operation {
+        Kind kind;
+        Image image;
+        unsigned int address;
+        unsigned int length;
+        Completion done;
+        /*Set for streamed operations only*/
+        Source source;
+        Sink sink;
+    };
+
+    /*An operation taken out of its session, waiting for its completion to be called*/
+    struct Finished {
+        Operation op;
+        ispState state;
+        unsigned int address;
+    };
+
+    /**
+     * Advances the session: sends held back packets, takes the current operation
+     * out when the state machine is done and starts the next one. The finished
+     * operation is handed back instead of being completed here, as its completion
+     * may destroy this session.
+     * Returns true while operations are pending.
+     */
+    bool poll(std::vector<Finished> &finished)
+    {
+        ispProcess(&mContext.ctx);
+        if (mActive)
+        {
+            if (ispIsBusy(&mContext.ctx))
+            {
+                if (!stalled())
+                    return true;
+                /*The target returns to idle as well, when it gets our abort*/
+                ispMasterAbort(&mContext.ctx);
+                if (ispIsBusy(&mContext.ctx))
+                    return true;
+            }
+            Finished f;
+            f.op = std::move(mCurrent);
+            f.state = mContext.ctx.state;
+            f.address = mContext.ctx.startAddr + mContext.ctx.offset;
+            finished.push_back(std::move(f));
+            mContext.ctx.state = ISP_STATE_IDLE;
+        }
+        {
+            /*idle() may be called from any thread*/
+            std::lock_guard<std::mutex> lock(mMutex);
+            mActive = !mQueue.empty();
+            if (!mActive)
+                return false;
+            mCurrent = std::move(mQueue.front());
+            mQueue.pop_front();
+        }
+        start();
+        return true;
+    }
+
+    /*C-type subclassing: the callbacks get back to us through the context*/
+    struct Context {
+        ispContext ctx;
+        Session *self;
+    };
+
+    static Operation operation(const Kind kind, Image image, const unsigned int address, const unsigned int length,
+            Completion done)
+    {
+        Operation op;
+        op.kind = kind;
+        op.address = address;
+        op.length = length;
+        op.image = std::move(image);
+        op.done = std::move(done);
+        return op;
+    }
+
+    void submit(Operation op)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mQueue.push_back(std::move(op));
+    }
+
+    void submit(const Kind kind, Image image, const unsigned int address, const unsigned int length, Completion done)
+    {
+        const unsigned int a = (kind == DOWNLOAD) ? address : image.address();
+        const unsigned int n = (kind == DOWNLOAD) ? length : image.size();
+        submit(operation(kind, std::move(image), a, n, std::move(done)));
+    }
+
+    std::future<Result> submit(const Kind kind, Image image, const unsigned int address, const unsigned int length)
+    {
+        std::shared_ptr<std::promise<Result> > promise(new std::promise<Result>());
+        std::future<Result> future = promise->get_future();
+        submit(kind, std::move(image), address, length, [promise](Result result) {
+            promise->set_value(std::move(result));
+        });
+        return future;
+    }
+
+    /*True if the current operation made no progress within the timeout*/
+    bool stalled()
+    {
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+        if (mTimeout.count() == 0)
+            return false;
+        if ((mContext.ctx.state != mLastState) || (mContext.ctx.offset != mLastOffset))
+        {
+            mLastState = mContext.ctx.state;
+            mLastOffset = mContext.ctx.offset;
+            mLastProgress = now;
+            return false;
+        }
+        return (now - mLastProgress >= mTimeout);
+    }
+
+    void start()
+    {
+        mCursor = 0;
+        if (mCurrent.kind == DOWNLOAD && !mCurrent.sink)
+        {
+            mCurrent.image = Image(mCurrent.address, std::vector<uint8_t>());
+            mCurrent.image.bytes().reserve(mCurrent.length);
+        }
+        ispMasterSetTarget(&mContext.ctx, mTargetId, mCurrent.address, mCurrent.length);
+        switch (mCurrent.kind)
+        {
+            case UPLOAD:
+                ispMasterStartUpload(&mContext.ctx);
+                break;
+            case DOWNLOAD:
+                ispMasterStartDownload(&mContext.ctx);
+                break;
+            case VERIFY:
+                ispMasterStartVerify(&mContext.ctx);
+                break;
+            case EXECUTE_BOOTLOADER:
+                ispMasterExecuteSlaveBootloader(&mContext.ctx);
+                break;
+            case EXECUTE_FIRMWARE:
+                ispMasterExecuteSlaveFirmware(&mContext.ctx);
+                break;
+        }
+        mLastState = mContext.ctx.state;
+        mLastOffset = mContext.ctx.offset;
+        mLastProgress = std::chrono::steady_clock::now();
+    }
+
+    static void finish(Operation &op, const ispState state, const unsigned int address)
+    {
+        Result result;
+        result.state = state;
+        result.address = address;
+        if (op.kind == DOWNLOAD)
+            result.image = std::move(op.image);
+        if (op.done)
+            op.done(std::move(result));
+    }
+
+    static unsigned int read(void *context, void *buffer, const unsigned int length)
+    {
+        Session *self = ((Context *)context)->self;
+        const Image &image = self->mCurrent.image;
+        unsigned int n;
+
+        if (self->mCurrent.source)
+            return self->mCurrent.source((uint8_t *)buffer, length);
+        n = std::min(length, image.size() - self->mCursor);
+
+        memcpy(buffer, image.data() + self->mCursor, n);
+        self->mCursor += n;
+        return n;
+    }
+
+    static void write(void *context, const void *buffer, const unsigned int length)
+    {
+        Session *self = ((Context *)context)->self;
+        const uint8_t *bytes = (const uint8_t *)buffer;
+
+        if (self->mCurrent.sink)
+        {
+            self->mCurrent.sink(bytes, length);
+            return;
+        }
+        self->mCurrent.image.bytes().insert(self->mCurrent.image.bytes().end(), bytes, bytes + length);
+    }
+
+    Executor &mExecutor;
+    Context mContext;
+    /*Packets held back by the limiter*/
+    ispPacketQueue mPending;
+    NDLComId mTargetId;
+    std::chrono::milliseconds mTimeout;
+    bool mActive;
+    Operation mCurrent;
+    unsigned int mCursor;
+    /*Progress of the current operation*/
+    ispState mLastState;
+    unsigned int mLastOffset;
+    std::chrono::steady_clock::time_point mLastProgress;
+    std::mutex mMutex;
+    std::deque<Operation> mQueue;
+};
+
+bool Executor::runOnce()
+{
+    std::vector<Session::Finished> finished;
+    bool busy = false;
+    size_t i;
+
+    ndlcomBridgeProcessOnce(&mBridge);
+    for (i = 0; i < mSessions.size(); ++i)
+        busy |= mSessions[i]->poll(finished);
+    /*Completions come last, they may destroy sessions or submit new operations*/
+    for (i = 0; i < finished.size(); ++i)
+        Session::finish(finished[i].op, finished[i].state, finished[i].address);
+    return busy || !finished.empty();
+}
+
+} // namespace isp
+
+#endif
@@ -1,21 +1,189 @@
+#include <string.h>
 #include "isp/isp.h"
 #include "representations/id.h"
 #include "representations/Isp.h"
 
+/*Access to the image/PROM: either through the context or fixed at compile time*/
+#if ISP_STATIC_CALLBACKS
+#define ISP_READ(ctx, buffer, size)  ISP_SLAVE_READ(ctx, buffer, size)
+#define ISP_WRITE(ctx, buffer, size) ISP_SLAVE_WRITE(ctx, buffer, size)
+#define ISP_EXEC(ctx)                ISP_SLAVE_EXEC(ctx)
+#if ISP_ENABLE_DOWNLOAD && !defined(ISP_SLAVE_READ)
+#error "ISP_SLAVE_READ has to be defined when ISP_ENABLE_DOWNLOAD is set"
+#endif
+#else
+#define ISP_READ(ctx, buffer, size)  (ctx)->read(ctx, buffer, size)
+#define ISP_WRITE(ctx, buffer, size) (ctx)->write(ctx, buffer, size)
+#define ISP_EXEC(ctx)                (ctx)->exec(ctx)
+#endif
+
 /*Internally used functions*/
-void ispSlaveHandler(void *context, const struct NDLComHeader *header, const void *payload, const void *origin);
-void ispSlaveCmdHandler(ispContext *ctx, const struct NDLComHeader *header, const struct IspCommand *cmd);
-void ispSlaveDataHandler(ispContext *ctx, const struct NDLComHeader *header, const struct IspData *data);
-void ispSendAck(ispContext *ctx, const uint32_t addr);
+static void ispSlaveHandler(void *context, const struct NDLComHeader *header, const void *payload, const void *origin);
+static void ispSlaveCmdHandler(ispContext *ctx, const struct NDLComHeader *header, const struct IspCommand *cmd);
+static void ispSlaveDataHandler(ispContext *ctx, const struct NDLComHeader *header, const struct IspData *data);
+static void ispSendAck(ispContext *ctx, const uint32_t addr);
+#if ISP_ENABLE_PREFETCH
+static void ispSlaveSendPrefetched(ispContext *ctx);
+#endif
+
+#if ISP_WINDOW_SIZE > 1
+static void ispWindowInit(ispContext *ctx, const unsigned char master);
+static void ispSlaveWindowDataHandler(ispContext *ctx, const struct IspData *data);
+static void ispSlaveWriteBlock(ispContext *ctx, const uint8_t *buffer);
+static void ispSlaveSendCumulativeAck(ispContext *ctx);
+#endif
 
-void ispMasterHandler(void *context, const struct NDLComHeader *header, const void *payload, const void *origin);
-void ispMasterCmdHandler(ispContext *ctx, const struct NDLComHeader *header, const struct IspCommand *cmd);
-void ispMasterDataHandler(ispContext *ctx, const struct NDLComHeader *header, const struct IspData *data);
-void ispSendCmd(ispContext *ctx, const uint8_t cmd, const uint32_t addr, const uint32_t len);
-int  ispSendData(ispContext *ctx);
+#if ISP_ENABLE_MASTER
+static void ispMasterHandler(void *context, const struct NDLComHeader *header, const void *payload, const void *origin);
+static void ispMasterCmdHandler(ispContext *ctx, const struct NDLComHeader *header, const struct IspCommand *cmd);
+static void ispMasterDataHandler(ispContext *ctx, const struct NDLComHeader *header, const struct IspData *data);
+#if ISP_WINDOW_SIZE > 1
+static void ispMasterWindowAck(ispContext *ctx, const struct IspCommand *cmd);
+static void ispMasterFillWindow(ispContext *ctx);
+static void ispMasterSack(ispContext *ctx, const struct IspCommand *cmd);
+static void ispMasterSendBlock(ispContext *ctx, const unsigned int pos);
+#endif
+#endif
+#if ISP_ENABLE_MASTER || ISP_WINDOW_SIZE > 1
+static void ispSendCmd(ispContext *ctx, const uint8_t cmd, const uint32_t addr, const uint32_t len);
+#endif
+#if ISP_ENABLE_MASTER || (ISP_ENABLE_DOWNLOAD && !ISP_ENABLE_PREFETCH)
+static int  ispSendData(ispContext *ctx);
+#endif
+
+static int  ispSend(ispContext *ctx, const void *payload, const unsigned int size);
+#if ISP_ENABLE_RATE_LIMIT || ISP_WINDOW_SIZE > 1
+static int  ispCanSend(ispContext *ctx);
+#endif
+#if ISP_ENABLE_RATE_LIMIT
+static void ispFlush(ispContext *ctx, const int force);
+static int  ispRateLimiterAcquire(ispRateLimiter *limiter);
+#endif
 
 /*Library functions*/
 
+/*PACING STUFF*/
+
+#if ISP_ENABLE_RATE_LIMIT
+void ispRateLimiterInit(ispRateLimiter *limiter, ispClockFunc clockFunc, const unsigned long rate, const unsigned long burst)
+{
+    limiter->clock = clockFunc;
+    limiter->rate = rate;
+    /*A bucket smaller than a packet never gets out of debt*/
+    limiter->burst = (burst < sizeof(struct IspData)) ? sizeof(struct IspData) : burst;
+    /*Start with a full bucket*/
+    limiter->tokens = limiter->burst;
+    limiter->lastTick = clockFunc();
+}
+
+void ispSetRateLimiter(ispContext *ctx, ispRateLimiter *limiter, ispPacketQueue *queue)
+{
+    /*One without the other is of no use*/
+    if (!limiter || !queue)
+    {
+        limiter = NULL;
+        queue = NULL;
+    }
+    if (queue != ctx->pending)
+    {
+        /*Packets held back so far would get lost with their queue*/
+        ispFlush(ctx, 1);
+        if (queue)
+        {
+            queue->first = 0;
+            queue->count = 0;
+        }
+    }
+    ctx->limiter = limiter;
+    ctx->pending = queue;
+}
+
+#endif
+
+void ispProcess(ispContext *ctx)
+{
+#if ISP_ENABLE_RATE_LIMIT
+    ispFlush(ctx, 0);
+#endif
+#if ISP_WINDOW_SIZE > 1
+    /*Slave: a held back acknowledgement is due*/
+    if (!ctx->master && (ctx->unacked > 0) && ctx->clock && (ctx->clock() - ctx->ackTime >= ISP_ACK_DELAY))
+        ispSlaveSendCumulativeAck(ctx);
+#if ISP_ENABLE_MASTER
+    if (ctx->master)
+    {
+        /*Master: nothing acknowledged for a while, the oldest block might be lost*/
+        if ((ctx->state == ISP_STATE_UPLOADING) && (ctx->window > 1) && ctx->clock &&
+            (ctx->offset < ctx->sent) && (ctx->clock() - ctx->ackTime >= ISP_RESEND_TIMEOUT))
+        {
+            ctx->resendPos = ctx->offset;
+            ctx->resendEnd = ctx->offset + ISP_DATA_TRANSMISSION_BLOCK_SIZE;
+            ctx->ackTime = ctx->clock();
+        }
+        /*Master: continue resending and filling the window once held back packets are out*/
+        ispMasterFillWindow(ctx);
+    }
+#endif
+#endif
+}
+
+/*WINDOW STUFF*/
+
+#if ISP_WINDOW_SIZE > 1
+static void ispWindowInit(ispContext *ctx, const unsigned char master)
+{
+    /*Stop-and-wait until both sides agreed on something else*/
+    ctx->master = master;
+    ctx->window = 1;
+    ctx->maxWindow = 1;
+    ctx->sent = 0;
+    ctx->resendPos = 0;
+    ctx->resendEnd = 0;
+    ctx->sacks = 0;
+    ctx->sackAddr = 0;
+    ctx->offer = 0;
+    ctx->received = 0;
+    ctx->unacked = 0;
+    ctx->ackTime = 0;
+    ctx->clock = NULL;
+}
+
+void ispSetClock(ispContext *ctx, ispClockFunc clockFunc)
+{
+    ctx->clock = clockFunc;
+}
+#endif
+
+/*COMMON STUFF*/
+
+void ispDestroy(ispContext *ctx)
+{
+    if (!ctx->node)
+        return;
+#if ISP_ENABLE_RATE_LIMIT
+    /*Do not lose packets which are still held back, nobody would send them later*/
+    ispFlush(ctx, 1);
+#endif
+    /*Deregister isp handler, so the node will not call into a dead context*/
+    ndlcomNodeDeregisterNodeHandler(ctx->node, &ctx->handler);
+    ctx->node = NULL;
+}
+
+int ispIsBusy(ispContext *ctx)
+{
+#if ISP_ENABLE_RATE_LIMIT
+    /*Packets held back by the rate limiter still have to be sent*/
+    if (ctx->pending && (ctx->pending->count > 0))
+        return 1;
+#endif
+    /*If the state is not the idle nor the error state, we still have work to do...*/
+    if (ctx->state == ISP_STATE_IDLE)
+        return 0;
+    if (ctx->state == ISP_STATE_ERROR)
+        return 0;
+    return 1;
+}
+
 /*SLAVE STUFF*/
 
 void ispSlaveCreate(ispContext *ctx, struct NDLComNode *node, ispReadFunc readFunc, ispWriteFunc writeFunc, ispExecFunc execFunc)
@@ -29,10 +197,28 @@ void ispSlaveCreate(ispContext *ctx, struct NDLComNode *node, ispReadFunc readFu
     ctx->sourceId = ctx->node->headerConfig.mOwnSenderId;
     ctx->targetId = NDLCOM_ADDR_BROADCAST;
 
+#if !ISP_STATIC_CALLBACKS
     /*Read and write functions*/
     ctx->read = readFunc;
     ctx->write = writeFunc;
     ctx->exec = execFunc;
+#endif
+
+#if ISP_ENABLE_PREFETCH
+    /*Nothing read ahead yet, and nothing will be without a limit*/
+    ctx->prefetchEnd = 0;
+    ctx->prefetchLength = 0;
+#endif
+
+#if ISP_WINDOW_SIZE > 1
+    ispWindowInit(ctx, 0);
+#endif
+
+#if ISP_ENABLE_RATE_LIMIT
+    /*No pacing by default*/
+    ctx->limiter = NULL;
+    ctx->pending = NULL;
+#endif
 
     /*NOTE: This means to implement a handler function (see lib/stm32common/src/isp.c)*/
     /*Register isp slave handler*/
@@ -40,7 +226,15 @@ void ispSlaveCreate(ispContext *ctx, struct NDLComNode *node, ispReadFunc readFu
     ndlcomNodeRegisterNodeHandler(ctx->node, &ctx->handler);
 }
 
-void ispSendAck(ispContext *ctx, const uint32_t addr)
+#if ISP_ENABLE_PREFETCH
+void ispSlaveSetPrefetchLimit(ispContext *ctx, const unsigned int endAddr)
+{
+    ctx->prefetchEnd = endAddr;
+    ctx->prefetchLength = 0;
+}
+#endif
+
+static void ispSendAck(ispContext *ctx, const uint32_t addr)
 {
     struct IspCommand command;
     command.mBase.mId = REPRESENTATIONS_REPRESENTATION_ID_IspCommand;
@@ -48,10 +242,10 @@ void ispSendAck(ispContext *ctx, const uint32_t addr)
     command.mAddress = addr;
     command.mLength = ctx->length - ctx->offset;
 
-    ndlcomNodeSend(ctx->node, ctx->targetId, &command, sizeof(command));
+    ispSend(ctx, &command, sizeof(command));
 }
 
-void ispSlaveCmdHandler(ispContext *ctx, const struct NDLComHeader *header, const struct IspCommand *cmd)
+static void ispSlaveCmdHandler(ispContext *ctx, const struct NDLComHeader *header, const struct IspCommand *cmd)
 {
     /*When we get an ACK and are in state UPLOADING, we read content from file and transmit it as DATA packet*/
     switch (cmd->mCommand)
@@ -65,13 +259,42 @@ void ispSlaveCmdHandler(ispContext *ctx, const struct NDLComHeader *header, cons
                 break;
             /*Ok, we can do it*/
             /*TODO: Check address and length, How?*/
+#if ISP_ENABLE_PREFETCH
+            /*The content is going to change*/
+            ctx->prefetchLength = 0;
+#endif
             ctx->startAddr = cmd->mAddress;
             ctx->offset = 0;
             ctx->length = cmd->mLength;
+#if ISP_WINDOW_SIZE > 1
+            ctx->received = 0;
+            ctx->unacked = 0;
+            /*Take the window offered right before, and tell the master in place of the length*/
+            ctx->window = 1;
+            if ((ctx->offer > 1) && (ctx->offerId == header->mSenderId) && (ctx->offerAddr == cmd->mAddress))
+                ctx->window = ctx->offer;
+            if (ctx->window > 1)
+            {
+                ispSendCmd(ctx, ISP_CMD_ACK, cmd->mAddress, ctx->window);
+                ctx->state = ISP_STATE_UPLOADING;
+                break;
+            }
+#endif
             /*Acknowledge and proceed*/
             ispSendAck(ctx, cmd->mAddress);
             ctx->state = ISP_STATE_UPLOADING;
             break;
+#if ISP_WINDOW_SIZE > 1
+        case ISP_CMD_WINDOW:
+            /*The master wants to send several blocks ahead during the upload following right behind*/
+            if (ctx->state != ISP_STATE_IDLE)
+                break;
+            ctx->offer = (cmd->mLength > ISP_WINDOW_SIZE) ? ISP_WINDOW_SIZE : cmd->mLength;
+            ctx->offerAddr = cmd->mAddress;
+            ctx->offerId = header->mSenderId;
+            break;
+#endif
+#if ISP_ENABLE_DOWNLOAD
         case ISP_CMD_DOWNLOAD:
             /*The master wants to download stuff from our PROM/Flash*/
             if (ctx->state != ISP_STATE_IDLE)
@@ -80,20 +303,38 @@ void ispSlaveCmdHandler(ispContext *ctx, const struct NDLComHeader *header, cons
             ctx->startAddr = cmd->mAddress;
             ctx->offset = 0;
             ctx->length = cmd->mLength;
+#if ISP_ENABLE_PREFETCH
+            ispSlaveSendPrefetched(ctx);
+#else
             ispSendData(ctx);
+#endif
             break;
+#endif
+#if !ISP_STATIC_CALLBACKS || defined(ISP_SLAVE_EXEC)
         case ISP_CMD_EXECUTE:
             /*We shall jump to the (newly) written code*/
             if (ctx->state != ISP_STATE_IDLE)
                 break;
+#if ISP_ENABLE_PREFETCH
+            /*Whatever runs next may change the content*/
+            ctx->prefetchLength = 0;
+#endif
             /*Acknowledge and execute*/
             ispSendAck(ctx, cmd->mAddress);
-            ctx->exec(ctx);
+            ISP_EXEC(ctx);
             break;
+#endif
         case ISP_CMD_ABORT:
+#if ISP_ENABLE_PREFETCH
+            /*The master may have changed the content in between*/
+            ctx->prefetchLength = 0;
+#endif
             /*Acknowledge and return to idle state*/
             ispSendAck(ctx, cmd->mAddress);
             ctx->state = ISP_STATE_IDLE;
+#if ISP_WINDOW_SIZE > 1
+            ctx->window = 1;
+#endif
             break;
         default:
             /*Unknown stuff? oO*/
@@ -101,13 +342,54 @@ void ispSlaveCmdHandler(ispContext *ctx, const struct NDLComHeader *header, cons
     }
 }
 
-void ispSlaveDataHandler(ispContext *ctx, const struct NDLComHeader *header, const struct IspData *data)
+#if ISP_ENABLE_PREFETCH
+static void ispSlaveSendPrefetched(ispContext *ctx)
+{
+    struct IspData data;
+    const unsigned int length = ctx->length;
+    unsigned int n = (length > ISP_DATA_TRANSMISSION_BLOCK_SIZE)?ISP_DATA_TRANSMISSION_BLOCK_SIZE:length;
+
+    data.mBase.mId = REPRESENTATIONS_REPRESENTATION_ID_IspData;
+    data.mAddress = ctx->startAddr;
+
+    /*Answer from RAM if we guessed right, otherwise read directly*/
+    if ((ctx->prefetchLength >= n) && (ctx->prefetchAddr == ctx->startAddr))
+        memcpy(data.mData, ctx->prefetch, n);
+    else
+        n = ISP_READ(ctx, data.mData, n);
+
+    ispSend(ctx, &data, sizeof(data));
+
+    /*While the data is on its way, read the block the master will most likely ask for next*/
+    ctx->prefetchLength = 0;
+    if ((n == 0) || (data.mAddress + n >= ctx->prefetchEnd))
+        return;
+    ctx->startAddr += n;
+    ctx->length = (ctx->prefetchEnd - ctx->startAddr > ISP_DATA_TRANSMISSION_BLOCK_SIZE)?ISP_DATA_TRANSMISSION_BLOCK_SIZE:ctx->prefetchEnd - ctx->startAddr;
+    ctx->prefetchAddr = ctx->startAddr;
+    ctx->prefetchLength = ISP_READ(ctx, ctx->prefetch, ctx->length);
+
+    /*Restore the original request*/
+    ctx->startAddr = data.mAddress;
+    ctx->length = length;
+}
+#endif
+
+static void ispSlaveDataHandler(ispContext *ctx, const struct NDLComHeader *header, const struct IspData *data)
 {
     int n = (ctx->length - ctx->offset > ISP_DATA_TRANSMISSION_BLOCK_SIZE)?ISP_DATA_TRANSMISSION_BLOCK_SIZE:ctx->length - ctx->offset;
 
     switch (ctx->state)
     {
         case ISP_STATE_UPLOADING:
+#if ISP_WINDOW_SIZE > 1
+            /*The master agreed on sending ahead*/
+            if (ctx->window > 1)
+            {
+                ispSlaveWindowDataHandler(ctx, data);
+                break;
+            }
+#endif
             /*Check if addresses match*/
             if (ctx->startAddr+ctx->offset > data->mAddress)
             {
@@ -122,7 +404,7 @@ void ispSlaveDataHandler(ispContext *ctx, const struct NDLComHeader *header, con
                 break;
             }
             /*Write data to buffer*/
-            ctx->write(ctx, data->mData, n);
+            ISP_WRITE(ctx, data->mData, n);
             /*Update offset*/
             ctx->offset += n;
             /*Check if we still have to write data*/
@@ -137,12 +419,101 @@ void ispSlaveDataHandler(ispContext *ctx, const struct NDLComHeader *header, con
             /*When we have successfully written the data we have to send an acknowledgement*/
             ispSendAck(ctx, data->mAddress);
             break;
+#if ISP_WINDOW_SIZE > 1
+        case ISP_STATE_IDLE:
+            /*A block of the finished upload was resent, so our final ACK got lost*/
+            if ((ctx->length > 0) && (ctx->offset >= ctx->length) &&
+                (data->mAddress >= ctx->startAddr) && (data->mAddress - ctx->startAddr < ctx->length))
+                ispSlaveSendCumulativeAck(ctx);
+            break;
+#endif
         default:
             break;
     }
 }
 
-void ispSlaveHandler(void *context, const struct NDLComHeader *header, const void *payload, const void *origin)
+#if ISP_WINDOW_SIZE > 1
+static void ispSlaveWriteBlock(ispContext *ctx, const uint8_t *buffer)
+{
+    int n = (ctx->length - ctx->offset > ISP_DATA_TRANSMISSION_BLOCK_SIZE)?ISP_DATA_TRANSMISSION_BLOCK_SIZE:ctx->length - ctx->offset;
+
+    ISP_WRITE(ctx, buffer, n);
+    ctx->offset += n;
+    /*Remember when the oldest unacknowledged block came in*/
+    if ((ctx->unacked++ == 0) && ctx->clock)
+        ctx->ackTime = ctx->clock();
+}
+
+static void ispSlaveSendCumulativeAck(ispContext *ctx)
+{
+    ctx->unacked = 0;
+    if (ctx->offset == 0)
+        return;
+    /*Acknowledge the last block we have written, this covers all blocks before*/
+    ispSendAck(ctx, ctx->startAddr + ((ctx->offset - 1) / ISP_DATA_TRANSMISSION_BLOCK_SIZE) * ISP_DATA_TRANSMISSION_BLOCK_SIZE);
+}
+
+static void ispSlaveWindowDataHandler(ispContext *ctx, const struct IspData *data)
+{
+    const uint32_t expected = ctx->startAddr + ctx->offset;
+    const unsigned int base = ctx->offset / ISP_DATA_TRANSMISSION_BLOCK_SIZE;
+    unsigned int block, first, ackEvery;
+
+    /*We already got this packet, the master might have missed our ACK*/
+    if (data->mAddress < expected)
+    {
+        ispSlaveSendCumulativeAck(ctx);
+        return;
+    }
+    /*Not at a block boundary, beyond the window or beyond the region: drop it, but tell where we are*/
+    block = (data->mAddress - expected) / ISP_DATA_TRANSMISSION_BLOCK_SIZE;
+    if (((data->mAddress - ctx->startAddr) % ISP_DATA_TRANSMISSION_BLOCK_SIZE != 0) || (block >= ctx->window) ||
+        (data->mAddress - ctx->startAddr >= ctx->length))
+    {
+        ispSlaveSendCumulativeAck(ctx);
+        return;
+    }
+
+    if (block > 0)
+    {
+        /*Out of order: keep it until the gap before is filled*/
+        memcpy(ctx->windowData[(base + block) % ISP_WINDOW_SIZE], data->mData, ISP_DATA_TRANSMISSION_BLOCK_SIZE);
+        ctx->received |= 1UL << ((base + block) % ISP_WINDOW_SIZE);
+        /*Report the gap in front of the first block we have, this acknowledges everything before as well*/
+        for (first = 1; !(ctx->received & (1UL << ((base + first) % ISP_WINDOW_SIZE))); ++first);
+        ctx->unacked = 0;
+        ispSendCmd(ctx, ISP_CMD_SACK, expected, first * ISP_DATA_TRANSMISSION_BLOCK_SIZE);
+        return;
+    }
+
+    /*In order: write it and everything we have buffered right behind it*/
+    ispSlaveWriteBlock(ctx, data->mData);
+    while (ctx->offset < ctx->length)
+    {
+        block = (ctx->offset / ISP_DATA_TRANSMISSION_BLOCK_SIZE) % ISP_WINDOW_SIZE;
+        if (!(ctx->received & (1UL << block)))
+            break;
+        ctx->received &= ~(1UL << block);
+        ispSlaveWriteBlock(ctx, ctx->windowData[block]);
+    }
+
+    if (ctx->offset >= ctx->length)
+    {
+        /*Ready :) The next upload has to negotiate again*/
+        ctx->state = ISP_STATE_IDLE;
+        ctx->window = 1;
+        ctx->received = 0;
+        ispSlaveSendCumulativeAck(ctx);
+        return;
+    }
+    /*Acknowledge at least twice per window, so the master never runs dry*/
+    ackEvery = (ctx->window / 2 < ISP_ACK_EVERY) ? ctx->window / 2 : ISP_ACK_EVERY;
+    if (ctx->unacked >= ackEvery)
+        ispSlaveSendCumulativeAck(ctx);
+}
+#endif
+
+static void ispSlaveHandler(void *context, const struct NDLComHeader *header, const void *payload, const void *origin)
 {
     /*Handle incoming isp stuff*/
     const struct Representation *repr = (const struct Representation *)payload;
@@ -169,10 +540,18 @@ void ispSlaveHandler(void *context, const struct NDLComHeader *header, const voi
         default:
             break;
     }
+
+#if ISP_WINDOW_SIZE > 1
+    /*A window offer only holds for the packet right behind it*/
+    if ((repr->mId != REPRESENTATIONS_REPRESENTATION_ID_IspCommand) ||
+        (((const struct IspCommand *)repr)->mCommand != ISP_CMD_WINDOW))
+        ctx->offer = 0;
+#endif
 }
 
 /*MASTER STUFF*/
 
+#if ISP_ENABLE_MASTER
 void ispMasterCreate(ispContext *ctx, struct NDLComNode *node, ispReadFunc readFunc, ispWriteFunc writeFunc)
 {
     /*Give some initial values*/
@@ -189,28 +568,22 @@ void ispMasterCreate(ispContext *ctx, struct NDLComNode *node, ispReadFunc readF
     ctx->read = readFunc;
     ctx->write = writeFunc;
     ctx->exec = NULL;
-    
+
+#if ISP_WINDOW_SIZE > 1
+    ispWindowInit(ctx, 1);
+#endif
+
+#if ISP_ENABLE_RATE_LIMIT
+    /*No pacing by default*/
+    ctx->limiter = NULL;
+    ctx->pending = NULL;
+#endif
+
     /*Register isp master handler*/
     ndlcomNodeHandlerInit(&ctx->handler, ispMasterHandler, 0, ctx);
     ndlcomNodeRegisterNodeHandler(ctx->node, &ctx->handler);
 }
 
-void ispDestroy(ispContext *ctx)
-{
-    /*TODO: Deregister isp handler*/
-    ctx->node = NULL;
-}
-
-int ispIsBusy(ispContext *ctx)
-{
-    /*If the state is not the idle nor the error state, we still have work to do...*/
-    if (ctx->state == ISP_STATE_IDLE)
-        return 0;
-    if (ctx->state == ISP_STATE_ERROR)
-        return 0;
-    return 1;
-}
-
 void ispMasterSetTarget(ispContext *ctx, const NDLComId targetId, const unsigned int addr, const unsigned int len)
 {
     if (ispIsBusy(ctx))
@@ -222,11 +595,30 @@ void ispMasterSetTarget(ispContext *ctx, const NDLComId targetId, const unsigned
     ctx->offset = 0;
 }
 
+#if ISP_WINDOW_SIZE > 1
+void ispMasterSetWindow(ispContext *ctx, const unsigned int blocks)
+{
+    if (ispIsBusy(ctx))
+        return;
+
+    ctx->maxWindow = (blocks > ISP_WINDOW_SIZE) ? ISP_WINDOW_SIZE : blocks;
+    if (ctx->maxWindow < 1)
+        ctx->maxWindow = 1;
+}
+#endif
+
 void ispMasterStartUpload(ispContext *ctx)
 {
     if (ispIsBusy(ctx))
         return;
 
+#if ISP_WINDOW_SIZE > 1
+    /*Stay with stop-and-wait unless the slave takes the window offered along with the upload*/
+    ctx->window = 1;
+    if (ctx->maxWindow > 1)
+        ispSendCmd(ctx, ISP_CMD_WINDOW, ctx->startAddr, ctx->maxWindow);
+#endif
+
     /*Send upload command*/
     ispSendCmd(ctx, ISP_CMD_UPLOAD, ctx->startAddr, ctx->length);
     ctx->state = ISP_STATE_ERASING;
@@ -252,6 +644,18 @@ void ispMasterStartVerify(ispContext *ctx)
     ctx->state = ISP_STATE_VERIFIING;
 }
 
+void ispMasterAbort(ispContext *ctx)
+{
+#if ISP_ENABLE_RATE_LIMIT
+    /*Whatever is still held back belongs to the operation we give up*/
+    if (ctx->pending)
+        ctx->pending->count = 0;
+#endif
+    /*Send abort command, the answer is of no interest*/
+    ispSendCmd(ctx, ISP_CMD_ABORT, ctx->startAddr, ctx->length);
+    ctx->state = ISP_STATE_ERROR;
+}
+
 /*FIXME This EXECUTE command is not well-formed ... it should be clear which image to load (from address?)*/
 void ispMasterExecuteSlaveBootloader (ispContext *ctx)
 {
@@ -265,8 +669,11 @@ void ispMasterExecuteSlaveFirmware (ispContext *ctx)
     ispSendCmd(ctx, ISP_CMD_EXECUTE, ctx->startAddr, ctx->length);
 }
 
+#endif
+
 /*Internally used function implementations*/
-void ispSendCmd(ispContext *ctx, const uint8_t cmd, const uint32_t addr, const uint32_t len)
+#if ISP_ENABLE_MASTER || ISP_WINDOW_SIZE > 1
+static void ispSendCmd(ispContext *ctx, const uint8_t cmd, const uint32_t addr, const uint32_t len)
 {
     struct IspCommand command;
     command.mBase.mId = REPRESENTATIONS_REPRESENTATION_ID_IspCommand;
@@ -274,10 +681,12 @@ void ispSendCmd(ispContext *ctx, const uint8_t cmd, const uint32_t addr, const u
     command.mAddress = addr;
     command.mLength = len;
 
-    ndlcomNodeSend(ctx->node, ctx->targetId, &command, sizeof(command));
+    ispSend(ctx, &command, sizeof(command));
 }
+#endif
 
-int ispSendData(ispContext *ctx)
+#if ISP_ENABLE_MASTER || (ISP_ENABLE_DOWNLOAD && !ISP_ENABLE_PREFETCH)
+static int ispSendData(ispContext *ctx)
 {
     struct IspData data;
     int n = (ctx->length - ctx->offset > ISP_DATA_TRANSMISSION_BLOCK_SIZE)?ISP_DATA_TRANSMISSION_BLOCK_SIZE:ctx->length - ctx->offset;
@@ -286,14 +695,103 @@ int ispSendData(ispContext *ctx)
     data.mAddress = ctx->startAddr + ctx->offset;
 
     /*Call read function*/
-    n = ctx->read(ctx, data.mData, n);
+    n = ISP_READ(ctx, data.mData, n);
 
-    ndlcomNodeSend(ctx->node, ctx->targetId, &data, sizeof(data));
+    ispSend(ctx, &data, sizeof(data));
 
     return n;
 }
+#endif
+
+/*Returns 0 if the packet was refused, because too many packets are held back already*/
+static int ispSend(ispContext *ctx, const void *payload, const unsigned int size)
+{
+#if ISP_ENABLE_RATE_LIMIT
+    ispPacketQueue *queue = ctx->pending;
+    unsigned int slot;
+
+    /*Without pacing everything goes out immediately*/
+    if (!queue)
+    {
+        ndlcomNodeSend(ctx->node, ctx->targetId, payload, size);
+        return 1;
+    }
+    /*Never exceed the budget to make room, the caller has to cope with it (see ispCanSend)*/
+    if (!ispCanSend(ctx))
+        return 0;
+    slot = (queue->first + queue->count) % ISP_RATE_LIMIT_QUEUE;
+    memcpy(&queue->packets[slot], payload, size);
+    queue->size[slot] = size;
+    queue->count++;
+    ispFlush(ctx, 0);
+#else
+    ndlcomNodeSend(ctx->node, ctx->targetId, payload, size);
+#endif
+    return 1;
+}
 
-void ispMasterCmdHandler(ispContext *ctx, const struct NDLComHeader *header, const struct IspCommand *cmd)
+#if ISP_ENABLE_RATE_LIMIT || ISP_WINDOW_SIZE > 1
+static int ispCanSend(ispContext *ctx)
+{
+#if ISP_ENABLE_RATE_LIMIT
+    return !ctx->pending || (ctx->pending->count < ISP_RATE_LIMIT_QUEUE);
+#else
+    return 1;
+#endif
+}
+#endif
+
+#if ISP_ENABLE_RATE_LIMIT
+static void ispFlush(ispContext *ctx, const int force)
+{
+    ispPacketQueue *queue = ctx->pending;
+
+    /*Unpaced contexts have nothing to hold back*/
+    if (!queue)
+        return;
+    while (queue->count > 0)
+    {
+        /*Wait until the bucket is out of debt*/
+        if (!ispRateLimiterAcquire(ctx->limiter) && !force)
+            return;
+        ctx->limiter->tokens -= queue->size[queue->first];
+        ndlcomNodeSend(ctx->node, ctx->targetId, &queue->packets[queue->first], queue->size[queue->first]);
+        queue->first = (queue->first + 1) % ISP_RATE_LIMIT_QUEUE;
+        queue->count--;
+    }
+}
+
+static int ispRateLimiterAcquire(ispRateLimiter *limiter)
+{
+    unsigned long now;
+    uint64_t gained;
+
+    /*A rate of zero means unlimited*/
+    if (limiter->rate == 0)
+        return 1;
+
+    /*Refill the bucket according to the elapsed time*/
+    now = limiter->clock();
+    gained = (uint64_t)(now - limiter->lastTick) * limiter->rate / 1000000;
+    if (gained > 0)
+    {
+        if (limiter->tokens + (int64_t)gained >= limiter->burst)
+        {
+            limiter->tokens = limiter->burst;
+            limiter->lastTick = now;
+        } else {
+            limiter->tokens += gained;
+            /*Only consume the time which has been converted to tokens to keep the remainder*/
+            limiter->lastTick += gained * 1000000 / limiter->rate;
+        }
+    }
+
+    return (limiter->tokens > 0);
+}
+#endif
+
+#if ISP_ENABLE_MASTER
+static void ispMasterCmdHandler(ispContext *ctx, const struct NDLComHeader *header, const struct IspCommand *cmd)
 {
     /*When we get an ACK and are in state UPLOADING, we read content from file and transmit it as DATA packet*/
     switch (cmd->mCommand)
@@ -303,9 +801,29 @@ void ispMasterCmdHandler(ispContext *ctx, const struct NDLComHeader *header, con
             switch (ctx->state)
             {
                 case ISP_STATE_UPLOADING:
+#if ISP_WINDOW_SIZE > 1
+                    if (ctx->window > 1)
+                    {
+                        ispMasterWindowAck(ctx, cmd);
+                        break;
+                    }
+#endif
                     /*Update offset*/
                     ctx->offset += ISP_DATA_TRANSMISSION_BLOCK_SIZE;
                 case ISP_STATE_ERASING:
+#if ISP_WINDOW_SIZE > 1
+                    /*
+                     * A slave taking our offer answers with the window instead of the length.
+                     * Regions short enough to be mistaken for it fit into one block anyway.
+                     */
+                    if ((ctx->state == ISP_STATE_ERASING) && (ctx->maxWindow > 1) && (cmd->mLength <= ctx->maxWindow))
+                        ctx->window = (cmd->mLength > 1) ? cmd->mLength : 1;
+                    if (ctx->window > 1)
+                    {
+                        ispMasterWindowAck(ctx, cmd);
+                        break;
+                    }
+#endif
                     /*Check if we had transmitted data*/
                     if (ispSendData(ctx) > 0)
                     {
@@ -323,12 +841,137 @@ void ispMasterCmdHandler(ispContext *ctx, const struct NDLComHeader *header, con
                     break;
             }
             break;
+#if ISP_WINDOW_SIZE > 1
+        case ISP_CMD_SACK:
+            /*The slave misses some blocks, but got the ones before and behind them*/
+            if ((ctx->state == ISP_STATE_UPLOADING) && (ctx->window > 1))
+                ispMasterSack(ctx, cmd);
+            break;
+#endif
         default:
             break;
     }
 }
 
-void ispMasterDataHandler(ispContext *ctx, const struct NDLComHeader *header, const struct IspData *data)
+#if ISP_WINDOW_SIZE > 1
+static void ispMasterWindowAck(ispContext *ctx, const struct IspCommand *cmd)
+{
+    unsigned int acked;
+
+    if (ctx->state == ISP_STATE_ERASING)
+    {
+        /*Erased, so we can start sending*/
+        ctx->offset = 0;
+        ctx->sent = 0;
+        ctx->resendPos = 0;
+        ctx->resendEnd = 0;
+        ctx->sacks = 0;
+        ctx->state = ISP_STATE_UPLOADING;
+        if (ctx->clock)
+            ctx->ackTime = ctx->clock();
+    } else if (cmd->mAddress >= ctx->startAddr) {
+        /*Cumulative: everything up to and including the block at mAddress has arrived*/
+        acked = cmd->mAddress - ctx->startAddr + ISP_DATA_TRANSMISSION_BLOCK_SIZE;
+        if (acked > ctx->sent)
+            acked = ctx->sent;
+        if (acked > ctx->offset)
+        {
+            ctx->offset = acked;
+            ctx->sacks = 0;
+            if (ctx->clock)
+                ctx->ackTime = ctx->clock();
+        }
+    }
+
+    if (ctx->offset >= ctx->length)
+    {
+        /*Ready :)*/
+        ctx->state = ISP_STATE_IDLE;
+        return;
+    }
+    ispMasterFillWindow(ctx);
+}
+
+static void ispMasterFillWindow(ispContext *ctx)
+{
+    unsigned int n;
+
+    if ((ctx->state != ISP_STATE_UPLOADING) || (ctx->window < 2))
+        return;
+
+    /*Missing blocks first, continue in ispProcess() when the rate limiter let older packets go*/
+    if (ctx->resendPos < ctx->offset)
+        ctx->resendPos = ctx->offset;
+    if (ctx->resendEnd > ctx->sent)
+        ctx->resendEnd = ctx->sent;
+    for (; (ctx->resendPos < ctx->resendEnd) && ispCanSend(ctx); ctx->resendPos += ISP_DATA_TRANSMISSION_BLOCK_SIZE)
+        ispMasterSendBlock(ctx, ctx->resendPos);
+
+    while ((ctx->resendPos >= ctx->resendEnd) && (ctx->sent < ctx->length) &&
+           (ctx->sent - ctx->offset < ctx->window * ISP_DATA_TRANSMISSION_BLOCK_SIZE))
+    {
+        if (!ispCanSend(ctx))
+            return;
+        n = (ctx->length - ctx->sent > ISP_DATA_TRANSMISSION_BLOCK_SIZE)?ISP_DATA_TRANSMISSION_BLOCK_SIZE:ctx->length - ctx->sent;
+        /*Keep the block until it is acknowledged*/
+        if (ISP_READ(ctx, ctx->windowData[(ctx->sent / ISP_DATA_TRANSMISSION_BLOCK_SIZE) % ISP_WINDOW_SIZE], n) < n)
+        {
+            /*The image ended early, so release the slave instead of leaving it waiting for the rest*/
+            ispMasterAbort(ctx);
+            return;
+        }
+        ispMasterSendBlock(ctx, ctx->sent);
+        ctx->sent += n;
+    }
+}
+
+static void ispMasterSack(ispContext *ctx, const struct IspCommand *cmd)
+{
+    unsigned int acked;
+
+    if (cmd->mAddress < ctx->startAddr)
+        return;
+    /*Everything in front of the gap has arrived*/
+    acked = cmd->mAddress - ctx->startAddr;
+    if (acked > ctx->sent)
+        acked = ctx->sent;
+    if (acked > ctx->offset)
+    {
+        ctx->offset = acked;
+        if (ctx->clock)
+            ctx->ackTime = ctx->clock();
+    }
+
+    /*Reordering reports a gap once, a lost block keeps being reported by every block behind it*/
+    if ((ctx->sacks == 0) || (ctx->sackAddr != cmd->mAddress))
+    {
+        ctx->sackAddr = cmd->mAddress;
+        ctx->sacks = 0;
+    }
+    /*Lost retransmissions show up as the same gap again, so give it another try after a window of reports*/
+    if (++ctx->sacks >= ISP_SACK_THRESHOLD + ctx->window)
+        ctx->sacks = ISP_SACK_THRESHOLD;
+    if (ctx->sacks == ISP_SACK_THRESHOLD)
+    {
+        ctx->resendPos = acked;
+        ctx->resendEnd = acked + cmd->mLength;
+    }
+    ispMasterFillWindow(ctx);
+}
+
+static void ispMasterSendBlock(ispContext *ctx, const unsigned int pos)
+{
+    struct IspData data;
+
+    data.mBase.mId = REPRESENTATIONS_REPRESENTATION_ID_IspData;
+    data.mAddress = ctx->startAddr + pos;
+    memcpy(data.mData, ctx->windowData[(pos / ISP_DATA_TRANSMISSION_BLOCK_SIZE) % ISP_WINDOW_SIZE], ISP_DATA_TRANSMISSION_BLOCK_SIZE);
+
+    ispSend(ctx, &data, sizeof(data));
+}
+#endif
+
+static void ispMasterDataHandler(ispContext *ctx, const struct NDLComHeader *header, const struct IspData *data)
 {
     /*When we get a data packet AND are in state DOWNLOADING, we write content to file and transmit a new DOWNLOAD command*/
     int n = (ctx->length - ctx->offset > ISP_DATA_TRANSMISSION_BLOCK_SIZE)?ISP_DATA_TRANSMISSION_BLOCK_SIZE:ctx->length - ctx->offset;
@@ -345,7 +988,7 @@ void ispMasterDataHandler(ispContext *ctx, const struct NDLComHeader *header, co
                 break;
             }
             /*Read content from provided function*/
-            n = ctx->read(ctx, buffer, n);
+            n = ISP_READ(ctx, buffer, n);
             /*Compare buffer with received data*/
             for (i = 0; i < n; ++i)
             {
@@ -381,7 +1024,7 @@ void ispMasterDataHandler(ispContext *ctx, const struct NDLComHeader *header, co
                 break;
             }
             /*Write data to buffer*/
-            ctx->write(ctx, data->mData, n);
+            ISP_WRITE(ctx, data->mData, n);
             /*Update offset*/
             ctx->offset += n;
             /*Check if we still have to read data*/
@@ -400,7 +1043,7 @@ void ispMasterDataHandler(ispContext *ctx, const struct NDLComHeader *header, co
     }
 }
 
-void ispMasterHandler(void *context, const struct NDLComHeader *header, const void *payload, const void *origin)
+static void ispMasterHandler(void *context, const struct NDLComHeader *header, const void *payload, const void *origin)
 {
     /*Handle incoming isp stuff*/
     const struct Representation *repr = (const struct Representation *)payload;
@@ -423,3 +1066,4 @@ void ispMasterHandler(void *context, const struct NDLComHeader *header, const vo
             break;
     }
 }
+#endif
@@ -0,0 +1,164 @@
+#include <string.h>
+
+#include "ndlcom/Node.h"
+#include "ndlcom/NodeHandler.h"
+#include "representations/id.h"
+#include "representations/Isp.h"
+
+#include "link.h"
+
+#define LINK_HANDLERS 8
+#define LINK_QUEUE 64
+
+/*Handlers are kept here, so nothing depends on the layout of NDLComNodeHandler*/
+static struct {
+    struct NDLComNodeHandler *handler;
+    NDLComNodeHandlerFunction function;
+    void *context;
+    struct NDLComNode *node;
+} handlers[LINK_HANDLERS];
+static unsigned int handlerCount;
+
+typedef struct {
+    NDLComId senderId;
+    NDLComId receiverId;
+    size_t length;
+    uint8_t payload[sizeof(struct IspData)];
+} linkPacket;
+
+static linkPacket queue[LINK_QUEUE];
+static unsigned int queueFirst, queueCount;
+static linkPacket held;
+static int holding;
+
+unsigned long linkSent;
+unsigned long linkDataSent;
+unsigned int linkDropEvery;
+unsigned int linkReorderEvery;
+int (*linkFilter)(const NDLComId senderId, const void *payload, const size_t length);
+
+void linkReset(void)
+{
+    handlerCount = 0;
+    queueFirst = 0;
+    queueCount = 0;
+    holding = 0;
+    linkSent = 0;
+    linkDataSent = 0;
+    linkDropEvery = 0;
+    linkReorderEvery = 0;
+    linkFilter = NULL;
+}
+
+static void linkQueue(const linkPacket *packet)
+{
+    if (queueCount < LINK_QUEUE)
+        queue[(queueFirst + queueCount++) % LINK_QUEUE] = *packet;
+}
+
+unsigned int linkProcess(void)
+{
+    const unsigned int count = queueCount;
+    struct NDLComHeader header;
+    linkPacket packet;
+    unsigned int i, j;
+
+    /*Nothing left to overtake the held back packet*/
+    if (holding && (queueCount == 0))
+    {
+        linkQueue(&held);
+        holding = 0;
+        return linkProcess();
+    }
+
+    /*Packets sent by the handlers are delivered with the next call*/
+    for (i = 0; i < count; ++i)
+    {
+        packet = queue[queueFirst];
+        queueFirst = (queueFirst + 1) % LINK_QUEUE;
+        queueCount--;
+
+        memset(&header, 0, sizeof(header));
+        header.mSenderId = packet.senderId;
+        header.mReceiverId = packet.receiverId;
+        header.mDataLen = packet.length;
+        for (j = 0; j < handlerCount; ++j)
+        {
+            const NDLComId id = handlers[j].node->headerConfig.mOwnSenderId;
+            if ((id != packet.senderId) && ((packet.receiverId == id) || (packet.receiverId == NDLCOM_ADDR_BROADCAST)))
+                handlers[j].function(handlers[j].context, &header, packet.payload, NULL);
+        }
+    }
+    return count;
+}
+
+void ndlcomNodeHandlerInit(struct NDLComNodeHandler *nodeHandler, NDLComNodeHandlerFunction handler,
+        const uint8_t flags, void *context)
+{
+    unsigned int i;
+
+    for (i = 0; (i < handlerCount) && (handlers[i].handler != nodeHandler); ++i);
+    if (i == LINK_HANDLERS)
+        return;
+    if (i == handlerCount)
+        handlerCount++;
+    handlers[i].handler = nodeHandler;
+    handlers[i].function = handler;
+    handlers[i].context = context;
+    handlers[i].node = NULL;
+}
+
+void ndlcomNodeRegisterNodeHandler(struct NDLComNode *node, struct NDLComNodeHandler *nodeHandler)
+{
+    unsigned int i;
+
+    for (i = 0; i < handlerCount; ++i)
+        if (handlers[i].handler == nodeHandler)
+            handlers[i].node = node;
+}
+
+void ndlcomNodeDeregisterNodeHandler(struct NDLComNode *node, struct NDLComNodeHandler *nodeHandler)
+{
+    unsigned int i;
+
+    for (i = 0; i < handlerCount; ++i)
+    {
+        if (handlers[i].handler == nodeHandler)
+        {
+            handlers[i] = handlers[--handlerCount];
+            return;
+        }
+    }
+}
+
+void ndlcomNodeSend(struct NDLComNode *node, const NDLComId receiverId, const void *payload, const size_t length)
+{
+    const struct Representation *repr = (const struct Representation *)payload;
+    linkPacket packet;
+
+    linkSent++;
+    if (repr->mId == REPRESENTATIONS_REPRESENTATION_ID_IspData)
+        linkDataSent++;
+    if ((linkDropEvery && (linkSent % linkDropEvery == 0)) ||
+        (linkFilter && linkFilter(node->headerConfig.mOwnSenderId, payload, length)) ||
+        (length > sizeof(packet.payload)))
+        return;
+
+    packet.senderId = node->headerConfig.mOwnSenderId;
+    packet.receiverId = receiverId;
+    packet.length = length;
+    memcpy(packet.payload, payload, length);
+
+    linkQueue(&packet);
+    if (holding)
+    {
+        /*The held back packet has been overtaken*/
+        linkQueue(&held);
+        holding = 0;
+    } else if (linkReorderEvery && (repr->mId == REPRESENTATIONS_REPRESENTATION_ID_IspData) &&
+               (linkDataSent % linkReorderEvery == 0)) {
+        held = packet;
+        holding = 1;
+        queueCount--;
+    }
+}
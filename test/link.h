@@ -0,0 +1,38 @@
+#ifndef __ISP_TEST_LINK_H
+#define __ISP_TEST_LINK_H
+
+#include <stddef.h>
+
+#include "ndlcom/Node.h"
+
+/*
+ * A simulated NDLCom link for protocol tests. It replaces the node functions used
+ * by isp.c: packets are queued when sent and delivered by linkProcess(), where
+ * some of them can get lost or overtaken.
+ */
+
+/*Packets handed to the link, and how many of them were IspData*/
+extern unsigned long linkSent;
+extern unsigned long linkDataSent;
+
+/*Lose every n-th packet (0: none)*/
+extern unsigned int linkDropEvery;
+
+/*Hold back every n-th IspData packet until the next packet has been sent (0: none)*/
+extern unsigned int linkReorderEvery;
+
+/*Optional: packets for which this returns non-zero are lost*/
+extern int (*linkFilter)(const NDLComId senderId, const void *payload, const size_t length);
+
+/**
+ * Forgets all handlers and queued packets and resets the counters and settings
+ */
+void linkReset(void);
+
+/**
+ * Delivers all packets queued so far to the handlers of their receivers.
+ * Returns the number of packets delivered
+ */
+unsigned int linkProcess(void);
+
+#endif
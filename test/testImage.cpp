@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "image.h"
+
+/*
+ * Checks the image loaders of the isp tool: every test writes a small image,
+ * opens it and compares the segments and their streamed content.
+ */
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: check '%s' failed\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+static std::vector<uint8_t> pattern(const unsigned int length, const uint8_t seed)
+{
+    std::vector<uint8_t> bytes(length);
+    unsigned int i;
+
+    for (i = 0; i < length; ++i)
+        bytes[i] = (uint8_t)(seed + i * 7);
+    return bytes;
+}
+
+static void writeFile(const char *filename, const std::string &content)
+{
+    FILE *fp = fopen(filename, "wb");
+    fwrite(content.data(), 1, content.size(), fp);
+    fclose(fp);
+}
+
+static std::string hexRecord(const uint8_t type, const unsigned int address, const std::vector<uint8_t> &data)
+{
+    std::vector<uint8_t> bytes;
+    std::string line = ":";
+    uint8_t sum = 0;
+    char text[4];
+    size_t i;
+
+    bytes.push_back(data.size());
+    bytes.push_back(address >> 8);
+    bytes.push_back(address);
+    bytes.push_back(type);
+    bytes.insert(bytes.end(), data.begin(), data.end());
+    for (i = 0; i < bytes.size(); ++i)
+        sum += bytes[i];
+    bytes.push_back(-sum);
+    for (i = 0; i < bytes.size(); ++i)
+    {
+        snprintf(text, sizeof(text), "%02X", bytes[i]);
+        line += text;
+    }
+    return line + "\r\n";
+}
+
+static std::string srecRecord(const char type, const unsigned int address, const unsigned int addrLen,
+        const std::vector<uint8_t> &data)
+{
+    std::vector<uint8_t> bytes;
+    std::string line = std::string("S") + type;
+    uint8_t sum = 0;
+    char text[4];
+    size_t i;
+
+    bytes.push_back(addrLen + data.size() + 1);
+    for (i = addrLen; i > 0; --i)
+        bytes.push_back(address >> (8 * (i - 1)));
+    bytes.insert(bytes.end(), data.begin(), data.end());
+    for (i = 0; i < bytes.size(); ++i)
+        sum += bytes[i];
+    bytes.push_back(~sum);
+    for (i = 0; i < bytes.size(); ++i)
+    {
+        snprintf(text, sizeof(text), "%02X", bytes[i]);
+        line += text;
+    }
+    return line + "\n";
+}
+
+static void putValue(std::string &buffer, const size_t offset, const uint64_t value, const unsigned int size, const bool bigEndian)
+{
+    unsigned int i;
+
+    if (buffer.size() < offset + size)
+        buffer.resize(offset + size, '\0');
+    for (i = 0; i < size; ++i)
+        buffer[offset + i] = (char)(value >> (8 * (bigEndian ? size - 1 - i : i)));
+}
+
+/*Reads the given segment in small pieces, so records are split in between*/
+static std::vector<uint8_t> readSegment(ispImage *image, const unsigned int segment)
+{
+    std::vector<uint8_t> content;
+    uint8_t buffer[5];
+    unsigned int n;
+
+    CHECK(ispImageSelect(image, segment) == 0);
+    while ((n = ispImageRead(image, buffer, sizeof(buffer))) > 0)
+        content.insert(content.end(), buffer, buffer + n);
+    return content;
+}
+
+static void testIntelHex()
+{
+    std::vector<uint8_t> a = pattern(32, 1), b = pattern(8, 2);
+    std::vector<uint8_t> ela(2), none;
+    std::string text;
+    ispImage image;
+
+    /*Extended linear address 0x0800, two contiguous records and one after a gap*/
+    ela[0] = 0x08;
+    ela[1] = 0x00;
+    text += hexRecord(0x04, 0, ela);
+    text += hexRecord(0x00, 0x0000, std::vector<uint8_t>(a.begin(), a.begin() + 16));
+    text += hexRecord(0x00, 0x0010, std::vector<uint8_t>(a.begin() + 16, a.end()));
+    text += hexRecord(0x00, 0x0100, b);
+    text += hexRecord(0x01, 0, none);
+    writeFile("testImage.hex", text);
+
+    CHECK(ispImageOpen(&image, "testImage.hex", 0, ISP_IMAGE_AUTO) == 0);
+    CHECK(image.format == ISP_IMAGE_IHEX);
+    CHECK(image.segments.size() == 2);
+    if (image.segments.size() == 2)
+    {
+        CHECK(image.segments[0].address == 0x08000000 && image.segments[0].length == 32);
+        CHECK(image.segments[1].address == 0x08000100 && image.segments[1].length == 8);
+        CHECK(readSegment(&image, 0) == a);
+        CHECK(readSegment(&image, 1) == b);
+    }
+    ispImageClose(&image);
+
+    /*A broken checksum rejects the whole image*/
+    text[text.size() - 3] = (text[text.size() - 3] == 'E') ? 'F' : 'E';
+    writeFile("testImage.hex", text);
+    CHECK(ispImageOpen(&image, "testImage.hex", 0, ISP_IMAGE_AUTO) != 0);
+}
+
+static void testSrec()
+{
+    std::vector<uint8_t> a = pattern(20, 3), header(3, 'x'), none;
+    std::string text;
+    ispImage image;
+
+    text += srecRecord('0', 0, 2, header);
+    text += srecRecord('3', 0x00001000, 4, std::vector<uint8_t>(a.begin(), a.begin() + 16));
+    text += srecRecord('3', 0x00001010, 4, std::vector<uint8_t>(a.begin() + 16, a.end()));
+    text += srecRecord('7', 0, 4, none);
+    writeFile("testImage.srec", text);
+
+    CHECK(ispImageOpen(&image, "testImage.srec", 0, ISP_IMAGE_AUTO) == 0);
+    CHECK(image.format == ISP_IMAGE_SREC);
+    CHECK(image.segments.size() == 1);
+    if (image.segments.size() == 1)
+    {
+        CHECK(image.segments[0].address == 0x1000 && image.segments[0].length == 20);
+        CHECK(readSegment(&image, 0) == a);
+    }
+    ispImageClose(&image);
+}
+
+static void testElf32()
+{
+    std::vector<uint8_t> text = pattern(40, 4), data = pattern(12, 5);
+    std::string elf("\x7f" "ELF", 4);
+    const size_t phoff = 52, content = phoff + 3 * 32;
+    ispImage image;
+
+    /*Little endian with a .text and a .data segment, a .bss and a note*/
+    putValue(elf, 4, 1, 1, false);
+    putValue(elf, 5, 1, 1, false);
+    putValue(elf, 28, phoff, 4, false);
+    putValue(elf, 42, 32, 2, false);
+    putValue(elf, 44, 3, 2, false);
+    /*.text: loaded at 0x08000000, linked at 0x00000000*/
+    putValue(elf, phoff + 0, 1, 4, false);
+    putValue(elf, phoff + 4, content, 4, false);
+    putValue(elf, phoff + 8, 0x00000000, 4, false);
+    putValue(elf, phoff + 12, 0x08000000, 4, false);
+    putValue(elf, phoff + 16, text.size(), 4, false);
+    /*.bss: nothing in the file*/
+    putValue(elf, phoff + 32, 1, 4, false);
+    putValue(elf, phoff + 32 + 12, 0x20000000, 4, false);
+    putValue(elf, phoff + 32 + 20, 256, 4, false);
+    /*.data: loaded right behind .text*/
+    putValue(elf, phoff + 64, 1, 4, false);
+    putValue(elf, phoff + 64 + 4, content + text.size(), 4, false);
+    putValue(elf, phoff + 64 + 12, 0x08000040, 4, false);
+    putValue(elf, phoff + 64 + 16, data.size(), 4, false);
+    elf.resize(content, '\0');
+    elf.append(text.begin(), text.end());
+    elf.append(data.begin(), data.end());
+    writeFile("testImage.elf", elf);
+
+    CHECK(ispImageOpen(&image, "testImage.elf", 0, ISP_IMAGE_AUTO) == 0);
+    CHECK(image.format == ISP_IMAGE_ELF);
+    CHECK(image.segments.size() == 2);
+    if (image.segments.size() == 2)
+    {
+        CHECK(image.segments[0].address == 0x08000000 && image.segments[0].length == 40);
+        CHECK(image.segments[1].address == 0x08000040 && image.segments[1].length == 12);
+        CHECK(readSegment(&image, 0) == text);
+        CHECK(readSegment(&image, 1) == data);
+    }
+    ispImageClose(&image);
+}
+
+static void testElf64()
+{
+    std::vector<uint8_t> text = pattern(300, 6);
+    std::string elf("\x7f" "ELF", 4);
+    const size_t phoff = 64, content = phoff + 56;
+    ispImage image;
+
+    /*Big endian*/
+    putValue(elf, 4, 2, 1, true);
+    putValue(elf, 5, 2, 1, true);
+    putValue(elf, 32, phoff, 8, true);
+    putValue(elf, 54, 56, 2, true);
+    putValue(elf, 56, 1, 2, true);
+    putValue(elf, phoff + 0, 1, 4, true);
+    putValue(elf, phoff + 8, content, 8, true);
+    putValue(elf, phoff + 24, 0x10000, 8, true);
+    putValue(elf, phoff + 32, text.size(), 8, true);
+    elf.resize(content, '\0');
+    elf.append(text.begin(), text.end());
+    writeFile("testImage64.elf", elf);
+
+    CHECK(ispImageOpen(&image, "testImage64.elf", 0, ISP_IMAGE_AUTO) == 0);
+    CHECK(image.format == ISP_IMAGE_ELF);
+    CHECK(image.segments.size() == 1);
+    if (image.segments.size() == 1)
+    {
+        CHECK(image.segments[0].address == 0x10000 && image.segments[0].length == 300);
+        CHECK(readSegment(&image, 0) == text);
+    }
+    ispImageClose(&image);
+}
+
+static void testBrokenElf()
+{
+    std::vector<uint8_t> text = pattern(40, 7);
+    std::string elf("\x7f" "ELF", 4);
+    const size_t phoff = 52, content = phoff + 32;
+    ispImage image;
+
+    /*A segment reaching beyond the end of the file*/
+    putValue(elf, 4, 1, 1, false);
+    putValue(elf, 5, 1, 1, false);
+    putValue(elf, 28, phoff, 4, false);
+    putValue(elf, 42, 32, 2, false);
+    putValue(elf, 44, 1, 2, false);
+    putValue(elf, phoff + 0, 1, 4, false);
+    putValue(elf, phoff + 4, content, 4, false);
+    putValue(elf, phoff + 12, 0x08000000, 4, false);
+    putValue(elf, phoff + 16, 0xf0000000, 4, false);
+    elf.resize(content, '\0');
+    elf.append(text.begin(), text.end());
+    writeFile("testImageBroken.elf", elf);
+    CHECK(ispImageOpen(&image, "testImageBroken.elf", 0, ISP_IMAGE_AUTO) != 0);
+
+    /*The same when only the offset is out of the file*/
+    putValue(elf, phoff + 4, 0xfffffff0, 4, false);
+    putValue(elf, phoff + 16, text.size(), 4, false);
+    writeFile("testImageBroken.elf", elf);
+    CHECK(ispImageOpen(&image, "testImageBroken.elf", 0, ISP_IMAGE_AUTO) != 0);
+
+    /*A forced format does not make something else an ELF file*/
+    putValue(elf, phoff + 4, content, 4, false);
+    elf[0] = 'E';
+    writeFile("testImageBroken.elf", elf);
+    CHECK(ispImageOpen(&image, "testImageBroken.elf", 0, ISP_IMAGE_ELF) != 0);
+}
+
+static void testBinary()
+{
+    std::vector<uint8_t> raw = pattern(200, ':');
+    std::string content(raw.begin(), raw.end());
+    ispImage image;
+
+    /*Raw content starting like Intel HEX*/
+    CHECK(raw[0] == ':');
+    writeFile("testImage.bin", content);
+    writeFile("testImage.dat", content);
+
+    /*The name tells it is raw*/
+    CHECK(ispImageOpen(&image, "testImage.bin", 0x4000, ISP_IMAGE_AUTO) == 0);
+    CHECK(image.format == ISP_IMAGE_BINARY);
+    CHECK(image.segments.size() == 1);
+    if (image.segments.size() == 1)
+    {
+        CHECK(image.segments[0].address == 0x4000 && image.segments[0].length == 200);
+        CHECK(readSegment(&image, 0) == raw);
+    }
+    ispImageClose(&image);
+
+    /*Otherwise the content is guessed wrong, unless the format is given*/
+    CHECK(ispImageOpen(&image, "testImage.dat", 0x4000, ISP_IMAGE_AUTO) != 0);
+    CHECK(ispImageOpen(&image, "testImage.dat", 0x4000, ISP_IMAGE_BINARY) == 0);
+    CHECK(image.format == ISP_IMAGE_BINARY);
+    CHECK(readSegment(&image, 0) == raw);
+    ispImageClose(&image);
+}
+
+static void testParseFormat()
+{
+    enum ispImageFormat format = ISP_IMAGE_AUTO;
+
+    CHECK(ispImageParseFormat("srec", &format) == 0 && format == ISP_IMAGE_SREC);
+    CHECK(ispImageParseFormat("bin", &format) == 0 && format == ISP_IMAGE_BINARY);
+    CHECK(ispImageParseFormat("auto", &format) == 0 && format == ISP_IMAGE_AUTO);
+    CHECK(ispImageParseFormat("coff", &format) != 0);
+}
+
+int main(int argc, char **argv)
+{
+    testIntelHex();
+    testSrec();
+    testElf32();
+    testElf64();
+    testBrokenElf();
+    testBinary();
+    testParseFormat();
+
+    if (failures > 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "isp/isp.h"
+#include "link.h"
+
+/*
+ * Checks the read ahead of slaves answering downloads on a simulated link: sequential
+ * downloads are answered from RAM, nothing is read at or beyond the limit, and the
+ * block read ahead is not used once the content may have changed.
+ */
+
+#define MASTER_ID 1
+#define SLAVE_ID 2
+#define BLOCKS 8
+#define FLASH (BLOCKS * ISP_DATA_TRANSMISSION_BLOCK_SIZE)
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: check '%s' failed\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+/*C-type subclassing: the callbacks get back to the test data through the context*/
+typedef struct {
+    ispContext ctx;
+    uint8_t received[FLASH];
+    unsigned int cursor;
+} testMaster;
+
+static uint8_t flash[FLASH];
+/*Reads of the slave, and the end of the furthest one*/
+static unsigned int reads;
+static unsigned int readEnd;
+
+static struct NDLComNode masterNode, slaveNode;
+static testMaster master;
+static ispContext slave;
+
+static unsigned int slaveRead(void *context, void *buffer, const unsigned int length)
+{
+    ispContext *ctx = (ispContext *)context;
+    const unsigned int addr = ctx->startAddr + ctx->offset;
+    unsigned int n = (addr >= FLASH) ? 0 : (length < FLASH - addr) ? length : FLASH - addr;
+
+    reads++;
+    if (addr + length > readEnd)
+        readEnd = addr + length;
+    memcpy(buffer, flash + addr, n);
+    return n;
+}
+
+static void slaveWrite(void *context, const void *buffer, const unsigned int length)
+{
+}
+
+static void slaveExec(void *context)
+{
+}
+
+static void masterWrite(void *context, const void *buffer, const unsigned int length)
+{
+    testMaster *self = (testMaster *)context;
+
+    memcpy(self->received + self->cursor, buffer, length);
+    self->cursor += length;
+}
+
+static void setUp(const unsigned int limit)
+{
+    unsigned int i;
+
+    linkReset();
+    masterNode.headerConfig.mOwnSenderId = MASTER_ID;
+    slaveNode.headerConfig.mOwnSenderId = SLAVE_ID;
+    for (i = 0; i < FLASH; ++i)
+        flash[i] = (uint8_t)(i * 7 + i / 11);
+    ispSlaveCreate(&slave, &slaveNode, slaveRead, slaveWrite, slaveExec);
+    ispSlaveSetPrefetchLimit(&slave, limit);
+    ispMasterCreate(&master.ctx, &masterNode, NULL, masterWrite);
+    reads = 0;
+    readEnd = 0;
+}
+
+static void tearDown(void)
+{
+    ispDestroy(&master.ctx);
+    ispDestroy(&slave);
+}
+
+/*Downloads addr..addr+length, returns 0 if it arrived unchanged*/
+static int download(const unsigned int addr, const unsigned int length)
+{
+    unsigned int step;
+
+    master.cursor = 0;
+    ispMasterSetTarget(&master.ctx, SLAVE_ID, addr, length);
+    ispMasterStartDownload(&master.ctx);
+    for (step = 0; (step < 1000) && ispIsBusy(&master.ctx); ++step)
+        linkProcess();
+    if ((master.ctx.state != ISP_STATE_IDLE) || (master.cursor != length))
+        return -1;
+    return memcmp(master.received, flash + addr, length) == 0 ? 0 : -1;
+}
+
+static void testWithoutLimit(void)
+{
+    /*Only what has been asked for*/
+    setUp(0);
+    CHECK(download(0, FLASH) == 0);
+    CHECK(reads == BLOCKS);
+    CHECK(readEnd == FLASH);
+    tearDown();
+}
+
+static void testSequential(void)
+{
+    /*One miss, then every request is answered from RAM while the next block is read*/
+    setUp(FLASH);
+    CHECK(download(0, FLASH) == 0);
+    CHECK(reads == BLOCKS);
+    CHECK(readEnd == FLASH);
+    tearDown();
+}
+
+static void testLimit(void)
+{
+    const unsigned int limit = 2 * ISP_DATA_TRANSMISSION_BLOCK_SIZE + ISP_DATA_TRANSMISSION_BLOCK_SIZE / 2;
+
+    /*The block behind the last request is cut at the limit*/
+    setUp(limit);
+    CHECK(download(0, 2 * ISP_DATA_TRANSMISSION_BLOCK_SIZE) == 0);
+    CHECK(reads == 3);
+    CHECK(readEnd == limit);
+    tearDown();
+}
+
+static void testMiss(void)
+{
+    /*A jump is read directly, the block read ahead is of no use*/
+    setUp(FLASH);
+    CHECK(download(0, ISP_DATA_TRANSMISSION_BLOCK_SIZE) == 0);
+    CHECK(download(3 * ISP_DATA_TRANSMISSION_BLOCK_SIZE, ISP_DATA_TRANSMISSION_BLOCK_SIZE) == 0);
+    CHECK(reads == 4);
+    tearDown();
+}
+
+static void testStale(void)
+{
+    const unsigned int next = ISP_DATA_TRANSMISSION_BLOCK_SIZE;
+
+    /*After an abort, the content read ahead might be outdated*/
+    setUp(FLASH);
+    CHECK(download(0, ISP_DATA_TRANSMISSION_BLOCK_SIZE) == 0);
+    flash[next] ^= 0xff;
+    ispMasterAbort(&master.ctx);
+    linkProcess();
+    CHECK(download(next, ISP_DATA_TRANSMISSION_BLOCK_SIZE) == 0);
+    tearDown();
+
+    /*The same when something else has been executed*/
+    setUp(FLASH);
+    CHECK(download(0, ISP_DATA_TRANSMISSION_BLOCK_SIZE) == 0);
+    flash[next] ^= 0xff;
+    ispMasterExecuteSlaveFirmware(&master.ctx);
+    linkProcess();
+    CHECK(download(next, ISP_DATA_TRANSMISSION_BLOCK_SIZE) == 0);
+    tearDown();
+}
+
+int main(int argc, char **argv)
+{
+    testWithoutLimit();
+    testSequential();
+    testLimit();
+    testMiss();
+    testStale();
+
+    if (failures > 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "isp/isp.h"
+#include "link.h"
+
+/*
+ * Checks pacing on a simulated link: the token bucket never lets more than its budget
+ * out, but does not hold back more than needed either, and packets are refused once
+ * the queue of a context is full.
+ */
+
+#define MASTER_ID 1
+#define SLAVE_ID 2
+#define BLOCKS 16
+#define LENGTH (BLOCKS * ISP_DATA_TRANSMISSION_BLOCK_SIZE)
+/*Bytes per second and simulated time per step, in microseconds*/
+#define RATE 20000
+#define STEP 1000
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: check '%s' failed\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+/*C-type subclassing: the callbacks get back to the test data through the context*/
+typedef struct {
+    ispContext ctx;
+    unsigned int cursor;
+} testMaster;
+
+static uint8_t image[LENGTH];
+static uint8_t flash[LENGTH];
+static unsigned long now;
+/*Bytes sent by the master and the budget it has been given*/
+static unsigned long masterBytes;
+static unsigned long burst;
+static int overBudget;
+
+static struct NDLComNode masterNode, slaveNode;
+static testMaster master;
+static ispContext slave;
+static ispRateLimiter limiter;
+static ispPacketQueue pending;
+
+static unsigned long testClock(void)
+{
+    return now;
+}
+
+static unsigned int masterRead(void *context, void *buffer, const unsigned int length)
+{
+    testMaster *self = (testMaster *)context;
+    unsigned int n = (length < LENGTH - self->cursor) ? length : LENGTH - self->cursor;
+
+    memcpy(buffer, image + self->cursor, n);
+    self->cursor += n;
+    return n;
+}
+
+static unsigned int slaveRead(void *context, void *buffer, const unsigned int length)
+{
+    return 0;
+}
+
+static void slaveWrite(void *context, const void *buffer, const unsigned int length)
+{
+    ispContext *ctx = (ispContext *)context;
+
+    memcpy(flash + ctx->startAddr + ctx->offset, buffer, length);
+}
+
+static void slaveExec(void *context)
+{
+}
+
+/*Counts what the master sends, the bucket may only go into debt by one packet*/
+static int countBytes(const NDLComId senderId, const void *payload, const size_t length)
+{
+    if (senderId != MASTER_ID)
+        return 0;
+    masterBytes += length;
+    if (masterBytes > burst + (unsigned long long)RATE * now / 1000000 + sizeof(struct IspData))
+        overBudget = 1;
+    return 0;
+}
+
+static void setUp(const unsigned long bucket)
+{
+    unsigned int i;
+
+    linkReset();
+    linkFilter = countBytes;
+    masterNode.headerConfig.mOwnSenderId = MASTER_ID;
+    slaveNode.headerConfig.mOwnSenderId = SLAVE_ID;
+    for (i = 0; i < LENGTH; ++i)
+        image[i] = (uint8_t)(i * 5 + i / 3);
+    memset(flash, 0, sizeof(flash));
+    now = 0;
+    masterBytes = 0;
+    overBudget = 0;
+
+    ispSlaveCreate(&slave, &slaveNode, slaveRead, slaveWrite, slaveExec);
+    ispMasterCreate(&master.ctx, &masterNode, masterRead, NULL);
+    master.cursor = 0;
+    ispRateLimiterInit(&limiter, testClock, RATE, bucket);
+    burst = limiter.burst;
+    ispSetRateLimiter(&master.ctx, &limiter, &pending);
+}
+
+static void tearDown(void)
+{
+    ispDestroy(&master.ctx);
+    ispDestroy(&slave);
+}
+
+static void testThroughput(void)
+{
+    unsigned int step;
+
+    /*Twice the size of a block, so the first blocks go out without waiting*/
+    setUp(2 * sizeof(struct IspData));
+    ispMasterSetTarget(&master.ctx, SLAVE_ID, 0, LENGTH);
+    ispMasterStartUpload(&master.ctx);
+    for (step = 0; (step < 100000) && ispIsBusy(&master.ctx); ++step)
+    {
+        linkProcess();
+        ispProcess(&master.ctx);
+        now += STEP;
+    }
+    linkProcess();
+
+    CHECK(master.ctx.state == ISP_STATE_IDLE);
+    CHECK(memcmp(flash, image, LENGTH) == 0);
+    CHECK(!overBudget);
+    /*Paced, but only by the bucket: done within a few steps of what the rate allows*/
+    CHECK(now <= (unsigned long long)(masterBytes - burst) * 1000000 / RATE + 10 * STEP);
+    tearDown();
+}
+
+static void testQueueFull(void)
+{
+    const unsigned long immediate = (sizeof(struct IspData) + sizeof(struct IspCommand) - 1) / sizeof(struct IspCommand);
+    unsigned int i;
+
+    /*Without time passing, a full bucket lets some commands out, the queue takes two more*/
+    setUp(0);
+    for (i = 0; i < immediate + ISP_RATE_LIMIT_QUEUE + 3; ++i)
+        ispMasterExecuteSlaveFirmware(&master.ctx);
+    CHECK(linkSent == immediate);
+    CHECK(pending.count == ISP_RATE_LIMIT_QUEUE);
+    CHECK(ispIsBusy(&master.ctx));
+
+    /*The held back ones leave once the bucket is out of debt, the refused ones never*/
+    ispProcess(&master.ctx);
+    CHECK(linkSent == immediate);
+    now += 1000000UL * sizeof(struct IspData) * 2 / RATE;
+    ispProcess(&master.ctx);
+    CHECK(linkSent == immediate + ISP_RATE_LIMIT_QUEUE);
+    CHECK(!ispIsBusy(&master.ctx));
+    CHECK(!overBudget);
+
+    /*Detaching the limiter sends what it still held back*/
+    now = 0;
+    ispRateLimiterInit(&limiter, testClock, RATE, 0);
+    for (i = 0; i < immediate + 1; ++i)
+        ispMasterExecuteSlaveFirmware(&master.ctx);
+    CHECK(ispIsBusy(&master.ctx));
+    ispSetRateLimiter(&master.ctx, NULL, NULL);
+    CHECK(!ispIsBusy(&master.ctx));
+    CHECK(linkSent == 2 * immediate + ISP_RATE_LIMIT_QUEUE + 1);
+    tearDown();
+}
+
+int main(int argc, char **argv)
+{
+    testThroughput();
+    testQueueFull();
+
+    if (failures > 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "isp/isp.h"
+#include "representations/id.h"
+#include "link.h"
+
+/*
+ * Checks windowed uploads on a simulated link: both ends have to agree on the
+ * window, reordered blocks must not be resent and lost ones have to be recovered.
+ */
+
+#define MASTER_ID 1
+#define SLAVE_ID 2
+#define BLOCKS 40
+/*The last block is a short one*/
+#define LENGTH (BLOCKS * ISP_DATA_TRANSMISSION_BLOCK_SIZE - 5)
+#define BASE 0x1000
+/*Simulated time per step, in microseconds*/
+#define STEP 1000
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: check '%s' failed\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+/*C-type subclassing: the callbacks get back to the test data through the context*/
+typedef struct {
+    ispContext ctx;
+    unsigned int cursor;
+} testMaster;
+
+typedef struct {
+    ispContext ctx;
+} testSlave;
+
+static uint8_t image[LENGTH];
+/*Bytes the master can read from its image*/
+static unsigned int available = LENGTH;
+static uint8_t flash[BASE + LENGTH];
+static unsigned long now;
+
+static unsigned long testClock(void)
+{
+    return now;
+}
+
+static unsigned int masterRead(void *context, void *buffer, const unsigned int length)
+{
+    testMaster *master = (testMaster *)context;
+    unsigned int n = (length < available - master->cursor) ? length : available - master->cursor;
+
+    memcpy(buffer, image + master->cursor, n);
+    master->cursor += n;
+    return n;
+}
+
+static unsigned int slaveRead(void *context, void *buffer, const unsigned int length)
+{
+    ispContext *ctx = (ispContext *)context;
+
+    memcpy(buffer, flash + ctx->startAddr + ctx->offset, length);
+    return length;
+}
+
+static void slaveWrite(void *context, const void *buffer, const unsigned int length)
+{
+    ispContext *ctx = (ispContext *)context;
+
+    memcpy(flash + ctx->startAddr + ctx->offset, buffer, length);
+}
+
+static void slaveExec(void *context)
+{
+}
+
+static void sendCommand(struct NDLComNode *node, const uint8_t command, const uint32_t address, const uint32_t length)
+{
+    struct IspCommand cmd;
+
+    cmd.mBase.mId = REPRESENTATIONS_REPRESENTATION_ID_IspCommand;
+    cmd.mCommand = command;
+    cmd.mAddress = address;
+    cmd.mLength = length;
+    ndlcomNodeSend(node, SLAVE_ID, &cmd, sizeof(cmd));
+}
+
+/*
+ * Runs an upload of the image with the given window, returns 0 if it completed in time.
+ * With staleOffer, the slave got an offer which was not followed by an upload.
+ */
+static int upload(const unsigned int window, const int withClock, const int staleOffer)
+{
+    static struct NDLComNode masterNode, slaveNode;
+    testMaster master;
+    testSlave slave;
+    unsigned int i, step;
+
+    masterNode.headerConfig.mOwnSenderId = MASTER_ID;
+    slaveNode.headerConfig.mOwnSenderId = SLAVE_ID;
+    for (i = 0; i < LENGTH; ++i)
+        image[i] = (uint8_t)(i * 13 + i / 7);
+    memset(flash, 0, sizeof(flash));
+    now = 0;
+
+    ispSlaveCreate(&slave.ctx, &slaveNode, slaveRead, slaveWrite, slaveExec);
+    ispMasterCreate(&master.ctx, &masterNode, masterRead, NULL);
+    master.cursor = 0;
+    ispMasterSetWindow(&master.ctx, window);
+    if (withClock)
+    {
+        ispSetClock(&master.ctx, testClock);
+        ispSetClock(&slave.ctx, testClock);
+    }
+    if (staleOffer)
+    {
+        sendCommand(&masterNode, ISP_CMD_WINDOW, BASE, 8);
+        sendCommand(&masterNode, ISP_CMD_ACK, BASE, 0);
+        linkProcess();
+    }
+    ispMasterSetTarget(&master.ctx, SLAVE_ID, BASE, LENGTH);
+    ispMasterStartUpload(&master.ctx);
+
+    for (step = 0; (step < 10000) && ispIsBusy(&master.ctx); ++step)
+    {
+        linkProcess();
+        ispProcess(&master.ctx);
+        ispProcess(&slave.ctx);
+        now += STEP;
+    }
+    /*Let the slave see the last packets*/
+    linkProcess();
+
+    /*Either way the slave is free for the next upload*/
+    CHECK(slave.ctx.state == ISP_STATE_IDLE);
+    if (master.ctx.state == ISP_STATE_IDLE)
+        CHECK(memcmp(flash + BASE, image, LENGTH) == 0);
+    ispDestroy(&master.ctx);
+    ispDestroy(&slave.ctx);
+    return (master.ctx.state == ISP_STATE_IDLE) ? 0 : -1;
+}
+
+/*Loses the window offer, as if the slave did not know the command*/
+static int dropOffer(const NDLComId senderId, const void *payload, const size_t length)
+{
+    const struct IspCommand *cmd = (const struct IspCommand *)payload;
+
+    return (cmd->mBase.mId == REPRESENTATIONS_REPRESENTATION_ID_IspCommand) && (cmd->mCommand == ISP_CMD_WINDOW);
+}
+
+static void testStopAndWait(void)
+{
+    linkReset();
+    CHECK(upload(1, 0, 0) == 0);
+    /*UPLOAD and its ACK, one ACK per block and an empty block when the master runs out of content*/
+    CHECK(linkSent == 3 + 2 * BLOCKS);
+    CHECK(linkDataSent == BLOCKS + 1);
+}
+
+static void testWindow(void)
+{
+    linkReset();
+    CHECK(upload(8, 0, 0) == 0);
+    /*Every block once, only about one ACK per ISP_ACK_EVERY blocks*/
+    CHECK(linkDataSent == BLOCKS);
+    CHECK(linkSent < 3 + BLOCKS + BLOCKS / 2);
+}
+
+static void testReordering(void)
+{
+    linkReset();
+    linkReorderEvery = 5;
+    CHECK(upload(8, 0, 0) == 0);
+    /*Blocks overtaken once are not resent*/
+    CHECK(linkDataSent == BLOCKS);
+    CHECK(linkSent < 3 + BLOCKS + BLOCKS / 2 + BLOCKS / 5);
+}
+
+static void testLoss(void)
+{
+    linkReset();
+    linkDropEvery = 13;
+    CHECK(upload(8, 1, 0) == 0);
+    CHECK(linkDataSent > BLOCKS);
+
+    /*Lost blocks at the very end are only found by the timeout*/
+    linkReset();
+    linkDropEvery = 7;
+    linkReorderEvery = 3;
+    CHECK(upload(8, 1, 0) == 0);
+}
+
+static void testReadError(void)
+{
+    /*The master aborts when its image ends early*/
+    linkReset();
+    available = LENGTH / 2;
+    CHECK(upload(8, 0, 0) != 0);
+    available = LENGTH;
+}
+
+static void testNegotiation(void)
+{
+    /*Without the offer, both ends stay with stop-and-wait*/
+    linkReset();
+    linkFilter = dropOffer;
+    CHECK(upload(8, 0, 0) == 0);
+    CHECK(linkSent == 1 + 3 + 2 * BLOCKS);
+
+    /*An offer only holds for the upload right behind it*/
+    linkReset();
+    CHECK(upload(1, 0, 1) == 0);
+    CHECK(linkSent == 2 + 3 + 2 * BLOCKS);
+}
+
+int main(int argc, char **argv)
+{
+    testStopAndWait();
+    testWindow();
+    testReordering();
+    testLoss();
+    testReadError();
+    testNegotiation();
+
+    if (failures > 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include "isp/isp.hpp"
+#include "daemon.h"
+#include "image.h"
+
+/*Idle sessions beyond this number are destroyed (and their handlers deregistered)*/
+#define ISP_DAEMON_MAX_SESSIONS 64
+
+static volatile sig_atomic_t running = 1;
+
+static void stopDaemon(int signal)
+{
+    running = 0;
+}
+
+/*A connected client with its unprocessed input and unsent output*/
+struct ispDaemonClient {
+    int fd;
+    std::string input;
+    std::string output;
+};
+
+/*Streams one segment of an image shared by all segments of a job*/
+struct ispDaemonSegmentSource {
+    std::shared_ptr<ispImage> image;
+    unsigned int segment;
+    bool selected;
+
+    unsigned int operator()(uint8_t *buffer, const unsigned int length)
+    {
+        /*Segments are transferred one after another, each one starts where it is*/
+        if (!selected)
+        {
+            selected = true;
+            if (ispImageSelect(image.get(), segment) != 0)
+                return 0;
+        }
+        return ispImageRead(image.get(), buffer, length);
+    }
+};
+
+static void closeImage(ispImage *image)
+{
+    ispImageClose(image);
+    delete image;
+}
+
+/*Collects the results of all segments belonging to one job*/
+struct ispDaemonJob {
+    unsigned int clientId;
+    std::string tag;
+    unsigned int outstanding;
+    std::string error;
+};
+
+class ispDaemon {
+public:
+    ispDaemon(struct NDLComBridge *bridge, struct NDLComNode *node, ispRateLimiter *limiter, const unsigned int timeoutMs)
+        : mExecutor(*bridge), mNode(node), mLimiter(limiter), mTimeout(timeoutMs), mNextClientId(0) {}
+
+    ~ispDaemon()
+    {
+        std::map<unsigned int, ispDaemonClient>::iterator it;
+        for (it = mClients.begin(); it != mClients.end(); ++it)
+            close(it->second.fd);
+    }
+
+    void accept(const int listenFd)
+    {
+        ispDaemonClient client;
+        client.fd = ::accept(listenFd, NULL, NULL);
+        if (client.fd < 0)
+            return;
+        fcntl(client.fd, F_SETFL, O_NONBLOCK);
+        mClients[mNextClientId++] = client;
+    }
+
+    /*Fills the poll set with the sockets of all clients*/
+    void pollSet(std::vector<struct pollfd> &fds, std::vector<unsigned int> &ids)
+    {
+        std::map<unsigned int, ispDaemonClient>::iterator it;
+        struct pollfd pfd;
+
+        for (it = mClients.begin(); it != mClients.end(); ++it)
+        {
+            pfd.fd = it->second.fd;
+            pfd.events = POLLIN | (it->second.output.empty() ? 0 : POLLOUT);
+            pfd.revents = 0;
+            fds.push_back(pfd);
+            ids.push_back(it->first);
+        }
+    }
+
+    void service(const unsigned int id, const short revents)
+    {
+        std::map<unsigned int, ispDaemonClient>::iterator it = mClients.find(id);
+        char buffer[512];
+        ssize_t n;
+        size_t end;
+
+        if (it == mClients.end())
+            return;
+        ispDaemonClient &client = it->second;
+
+        if (revents & POLLIN)
+        {
+            n = read(client.fd, buffer, sizeof(buffer));
+            if (n <= 0)
+            {
+                /*Jobs of this client are still executed, their answers are dropped*/
+                close(client.fd);
+                mClients.erase(it);
+                return;
+            }
+            client.input.append(buffer, n);
+            while ((end = client.input.find('\n')) != std::string::npos)
+            {
+                std::string line = client.input.substr(0, end);
+                client.input.erase(0, end + 1);
+                submit(id, line);
+            }
+        }
+        if ((revents & POLLOUT) && !client.output.empty())
+        {
+            n = write(client.fd, client.output.data(), client.output.size());
+            if (n > 0)
+                client.output.erase(0, n);
+        }
+        if (revents & (POLLERR | POLLHUP))
+        {
+            close(client.fd);
+            mClients.erase(id);
+        }
+    }
+
+    bool runOnce()
+    {
+        return mExecutor.runOnce();
+    }
+
+private:
+    void reply(const unsigned int clientId, const std::string &tag, const std::string &error)
+    {
+        std::map<unsigned int, ispDaemonClient>::iterator it = mClients.find(clientId);
+        if (it == mClients.end())
+            return;
+        it->second.output += tag + (error.empty() ? " OK\n" : " ERROR " + error + "\n");
+    }
+
+    /*Returns the pooled session for a target, creating it if needed*/
+    isp::Session &session(const NDLComId targetId)
+    {
+        std::map<NDLComId, std::unique_ptr<isp::Session> >::iterator it = mSessions.find(targetId);
+
+        if (it != mSessions.end())
+            return *it->second;
+        /*Make room by dropping idle sessions*/
+        if (mSessions.size() >= ISP_DAEMON_MAX_SESSIONS)
+        {
+            for (it = mSessions.begin(); it != mSessions.end();)
+            {
+                if (it->second->idle())
+                    mSessions.erase(it++);
+                else
+                    ++it;
+            }
+        }
+        std::unique_ptr<isp::Session> &entry = mSessions[targetId];
+        entry.reset(new isp::Session(mExecutor, *mNode, targetId, mLimiter));
+        entry->setTimeout(mTimeout);
+        return *entry;
+    }
+
+    isp::Completion completion(std::shared_ptr<ispDaemonJob> job, const std::string &what)
+    {
+        return [this, job, what](isp::Result result) {
+            char text[64];
+            if (!result.ok() && job->error.empty())
+            {
+                snprintf(text, sizeof(text), "%s failed at address 0x%x", what.c_str(), result.address);
+                job->error = text;
+            }
+            if (--job->outstanding == 0)
+                reply(job->clientId, job->tag, job->error);
+        };
+    }
+
+    /*Parses one request line and queues the resulting operations*/
+    void submit(const unsigned int clientId, const std::string &line)
+    {
+        std::istringstream request(line);
+        std::string tag, command, filename, arg;
+        enum ispImageFormat format = ISP_IMAGE_AUTO;
+        unsigned int nodeId = 0;
+        unsigned int address = 0;
+        unsigned int size = 0;
+        std::shared_ptr<ispDaemonJob> job(new ispDaemonJob());
+        unsigned int i;
+
+        if (!(request >> tag >> command >> nodeId))
+        {
+            reply(clientId, tag.empty() ? "-" : tag, "malformed request");
+            return;
+        }
+        /*Sessions are only created for valid requests*/
+        if (command != "execute" && command != "download" && command != "upload" && command != "verify")
+        {
+            reply(clientId, tag, "unknown command '" + command + "'");
+            return;
+        }
+        if (nodeId >= NDLCOM_ADDR_BROADCAST)
+        {
+            reply(clientId, tag, "invalid node id");
+            return;
+        }
+        job->clientId = clientId;
+        job->tag = tag;
+        job->outstanding = 0;
+
+        if (command == "execute")
+        {
+            if (!(request >> arg) || (arg != "bl" && arg != "fw"))
+            {
+                reply(clientId, tag, "usage: execute <node_id> bl|fw");
+                return;
+            }
+            job->outstanding = 1;
+            session(nodeId).execute(arg == "bl", completion(job, command));
+        } else if (command == "download") {
+            if (!(request >> filename >> std::hex >> address >> std::dec >> size) || size == 0)
+            {
+                reply(clientId, tag, "usage: download <node_id> <file> <address> <size>");
+                return;
+            }
+            /*The content goes straight into the file, whatever size was asked for*/
+            std::shared_ptr<FILE> fp(fopen(filename.c_str(), "wb"), [](FILE *f) { if (f) fclose(f); });
+            if (!fp)
+            {
+                reply(clientId, tag, "could not open file");
+                return;
+            }
+            job->outstanding = 1;
+            isp::Completion done = completion(job, command);
+            session(nodeId).download(address, size, [fp](const uint8_t *data, const unsigned int length) {
+                fwrite(data, 1, length, fp.get());
+            }, [done, fp](isp::Result result) {
+                if (result.ok() && (ferror(fp.get()) || fflush(fp.get()) != 0))
+                    result.state = ISP_STATE_ERROR;
+                done(std::move(result));
+            });
+        } else if (command == "upload" || command == "verify") {
+            if (!(request >> filename))
+            {
+                reply(clientId, tag, "usage: " + command + " <node_id> <file> [<address> [<format>]]");
+                return;
+            }
+            if ((request >> std::hex >> address >> arg) && (ispImageParseFormat(arg.c_str(), &format) != 0))
+            {
+                reply(clientId, tag, "unknown image format '" + arg + "'");
+                return;
+            }
+            /*The job keeps its own image open until its last segment is done*/
+            std::shared_ptr<ispImage> image(new ispImage(), closeImage);
+            if (ispImageOpen(image.get(), filename.c_str(), address, format) != 0)
+            {
+                reply(clientId, tag, "could not open image");
+                return;
+            }
+            /*Every segment becomes an operation of its own, streamed from the file*/
+            isp::Session &target = session(nodeId);
+            job->outstanding = image->segments.size();
+            if (job->outstanding == 0)
+                reply(clientId, tag, "");
+            for (i = 0; i < image->segments.size(); ++i)
+            {
+                ispDaemonSegmentSource source = {image, i, false};
+                if (command == "upload")
+                    target.upload(image->segments[i].address, image->segments[i].length, source, completion(job, command));
+                else
+                    target.verify(image->segments[i].address, image->segments[i].length, source, completion(job, command));
+            }
+        }
+    }
+
+    isp::Executor mExecutor;
+    struct NDLComNode *mNode;
+    ispRateLimiter *mLimiter;
+    std::chrono::milliseconds mTimeout;
+    unsigned int mNextClientId;
+    std::map<unsigned int, ispDaemonClient> mClients;
+    /*Declared last, so sessions are destroyed before anything they refer to*/
+    std::map<NDLComId, std::unique_ptr<isp::Session> > mSessions;
+};
+
+int ispDaemonRun(struct NDLComBridge *bridge, struct NDLComNode *node, ispRateLimiter *limiter,
+        const unsigned int timeoutMs, const char *socketPath)
+{
+    struct sockaddr_un addr;
+    std::vector<struct pollfd> fds;
+    std::vector<unsigned int> ids;
+    struct pollfd listener;
+    bool busy = false;
+    int listenFd;
+    size_t i;
+
+    if (strlen(socketPath) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path '%s' is too long\n", socketPath);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path) - 1);
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath);
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenFd, 16) != 0)
+    {
+        fprintf(stderr, "Could not listen on '%s': %s\n", socketPath, strerror(errno));
+        if (listenFd >= 0)
+            close(listenFd);
+        return -1;
+    }
+
+    signal(SIGINT, stopDaemon);
+    signal(SIGTERM, stopDaemon);
+    signal(SIGPIPE, SIG_IGN);
+    printf("Waiting for jobs on '%s'\n", socketPath);
+
+    {
+        ispDaemon daemon(bridge, node, limiter, timeoutMs);
+
+        listener.fd = listenFd;
+        listener.events = POLLIN;
+        while (running)
+        {
+            fds.assign(1, listener);
+            ids.assign(1, 0);
+            daemon.pollSet(fds, ids);
+            /*Do not wait for clients while transfers are running*/
+            if (poll(fds.data(), fds.size(), busy ? 0 : 1) > 0)
+            {
+                if (fds[0].revents & POLLIN)
+                    daemon.accept(listenFd);
+                for (i = 1; i < fds.size(); ++i)
+                {
+                    if (fds[i].revents)
+                        daemon.service(ids[i], fds[i].revents);
+                }
+            }
+            busy = daemon.runOnce();
+        }
+    }
+
+    close(listenFd);
+    unlink(socketPath);
+    return 0;
+}
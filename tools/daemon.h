@@ -0,0 +1,29 @@
+#ifndef __ISP_DAEMON_H
+#define __ISP_DAEMON_H
+
+#include "ndlcom/Bridge.h"
+#include "ndlcom/Node.h"
+#include "isp/isp.h"
+
+/**
+ * Keeps the given bridge and node open and executes ISP jobs received on a
+ * unix domain socket at socketPath. Each line sent by a client is one job:
+ *
+ *   <tag> upload <node_id> <file> [<address> [<format>]]
+ *   <tag> verify <node_id> <file> [<address> [<format>]]
+ *   <tag> download <node_id> <file> <address> <size>
+ *   <tag> execute <node_id> bl|fw
+ *
+ * The format (auto, bin, hex, srec or elf) defaults to auto, see ispImageOpen().
+ * The tag is chosen by the client and returned with the answer, which is
+ * either "<tag> OK" or "<tag> ERROR <reason>". Jobs for the same target are
+ * executed in order, jobs for different targets in parallel.
+ * Jobs for a target making no progress for timeoutMs milliseconds are aborted
+ * and answered with an error, so later jobs for it are not blocked (0 waits forever).
+ * The limiter (may be NULL) is shared by all targets.
+ * Returns when SIGINT or SIGTERM is received.
+ */
+int ispDaemonRun(struct NDLComBridge *bridge, struct NDLComNode *node, ispRateLimiter *limiter,
+        const unsigned int timeoutMs, const char *socketPath);
+
+#endif
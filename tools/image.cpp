@@ -0,0 +1,400 @@
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "image.h"
+
+/*Results of reading a single text record*/
+#define ISP_RECORD_DATA     1
+#define ISP_RECORD_OTHER    0
+#define ISP_RECORD_END     -1
+#define ISP_RECORD_INVALID -2
+
+/*ELF stuff we need*/
+#define ISP_ELF_CLASS32 1
+#define ISP_ELF_CLASS64 2
+#define ISP_ELF_DATA2MSB 2
+#define ISP_ELF_PT_LOAD 1
+
+static int hexValue(const char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*Converts pairs of hex digits into bytes, returns the number of bytes or -1*/
+static int hexDecode(const char *text, uint8_t *bytes, const unsigned int maxBytes)
+{
+    unsigned int n = 0;
+    int hi, lo;
+
+    while (*text && !isspace((unsigned char)*text))
+    {
+        if (n >= maxBytes)
+            return -1;
+        hi = hexValue(text[0]);
+        lo = (hi < 0) ? -1 : hexValue(text[1]);
+        if (lo < 0)
+            return -1;
+        bytes[n++] = (hi << 4) | lo;
+        text += 2;
+    }
+    return n;
+}
+
+/*Reads the next IHEX or SREC record into image->record*/
+static int nextRecord(ispImage *image, unsigned int *address)
+{
+    char line[600];
+    uint8_t bytes[300];
+    uint8_t sum = 0;
+    int i, n, addrLen;
+
+    if (!fgets(line, sizeof(line), image->fp))
+        return ISP_RECORD_END;
+    /*Skip empty lines*/
+    if (line[0] == '\r' || line[0] == '\n')
+        return ISP_RECORD_OTHER;
+
+    if (image->format == ISP_IMAGE_IHEX)
+    {
+        /* :LLAAAATT<data>CC */
+        if (line[0] != ':')
+            return ISP_RECORD_INVALID;
+        n = hexDecode(line + 1, bytes, sizeof(bytes));
+        if (n < 5 || n != bytes[0] + 5)
+            return ISP_RECORD_INVALID;
+        for (i = 0; i < n; ++i)
+            sum += bytes[i];
+        if (sum != 0)
+            return ISP_RECORD_INVALID;
+        switch (bytes[3])
+        {
+            case 0x00:
+                *address = image->base + ((bytes[1] << 8) | bytes[2]);
+                image->recordLength = bytes[0];
+                memcpy(image->record, bytes + 4, bytes[0]);
+                return ISP_RECORD_DATA;
+            case 0x01:
+                return ISP_RECORD_END;
+            case 0x02:
+                /*Extended segment address*/
+                if (bytes[0] != 2)
+                    return ISP_RECORD_INVALID;
+                image->base = ((bytes[4] << 8) | bytes[5]) << 4;
+                return ISP_RECORD_OTHER;
+            case 0x04:
+                /*Extended linear address*/
+                if (bytes[0] != 2)
+                    return ISP_RECORD_INVALID;
+                image->base = ((bytes[4] << 8) | bytes[5]) << 16;
+                return ISP_RECORD_OTHER;
+            default:
+                /*Start addresses are of no interest to us*/
+                return ISP_RECORD_OTHER;
+        }
+    }
+
+    /* S<type><count><address><data><checksum> */
+    if (line[0] != 'S' || !isdigit((unsigned char)line[1]))
+        return ISP_RECORD_INVALID;
+    n = hexDecode(line + 2, bytes, sizeof(bytes));
+    if (n < 3 || n != bytes[0] + 1)
+        return ISP_RECORD_INVALID;
+    for (i = 0; i < n; ++i)
+        sum += bytes[i];
+    if (sum != 0xff)
+        return ISP_RECORD_INVALID;
+    switch (line[1])
+    {
+        case '1':
+        case '2':
+        case '3':
+            addrLen = line[1] - '0' + 1;
+            break;
+        case '7':
+        case '8':
+        case '9':
+            return ISP_RECORD_END;
+        default:
+            /*Header and count records*/
+            return ISP_RECORD_OTHER;
+    }
+    if (bytes[0] < addrLen + 1)
+        return ISP_RECORD_INVALID;
+    *address = 0;
+    for (i = 0; i < addrLen; ++i)
+        *address = (*address << 8) | bytes[1 + i];
+    image->recordLength = bytes[0] - addrLen - 1;
+    memcpy(image->record, bytes + 1 + addrLen, image->recordLength);
+    return ISP_RECORD_DATA;
+}
+
+/*Builds the segment list by scanning all records once*/
+static int scanRecords(ispImage *image)
+{
+    unsigned int address = 0;
+    unsigned int base;
+    long position;
+    int result;
+    ispImageSegment segment;
+
+    image->base = 0;
+    while (1)
+    {
+        position = ftell(image->fp);
+        base = image->base;
+        result = nextRecord(image, &address);
+        if (result == ISP_RECORD_END)
+            break;
+        if (result == ISP_RECORD_INVALID)
+        {
+            fprintf(stderr, "Invalid record at file offset %ld\n", position);
+            return -1;
+        }
+        if (result != ISP_RECORD_DATA || image->recordLength == 0)
+            continue;
+        /*Extend the last segment if contiguous, otherwise start a new one*/
+        if (!image->segments.empty() &&
+            (image->segments.back().address + image->segments.back().length == address))
+        {
+            image->segments.back().length += image->recordLength;
+            continue;
+        }
+        segment.address = address;
+        segment.length = image->recordLength;
+        segment.fileOffset = position;
+        segment.base = base;
+        image->segments.push_back(segment);
+    }
+    return 0;
+}
+
+static uint64_t elfValue(const uint8_t *bytes, const unsigned int size, const int bigEndian)
+{
+    uint64_t value = 0;
+    unsigned int i;
+
+    for (i = 0; i < size; ++i)
+        value |= (uint64_t)bytes[bigEndian ? i : size - 1 - i] << (8 * (size - 1 - i));
+    return value;
+}
+
+/*Collects all loadable program headers of an ELF file*/
+static int scanElf(ispImage *image)
+{
+    uint8_t header[64];
+    uint8_t phdr[56];
+    int is64, bigEndian;
+    uint64_t phoff, fileSize, offset, length;
+    unsigned int phentsize, phnum, i;
+    ispImageSegment segment;
+
+    if (fseek(image->fp, 0, SEEK_END) != 0)
+        return -1;
+    fileSize = ftell(image->fp);
+    rewind(image->fp);
+    if (fread(header, 1, sizeof(header), image->fp) < 52)
+        return -1;
+    /*The format may have been forced on something else*/
+    if (header[0] != 0x7f || header[1] != 'E' || header[2] != 'L' || header[3] != 'F')
+        return -1;
+    is64 = (header[4] == ISP_ELF_CLASS64);
+    bigEndian = (header[5] == ISP_ELF_DATA2MSB);
+    if (!is64 && header[4] != ISP_ELF_CLASS32)
+        return -1;
+
+    phoff     = is64 ? elfValue(header + 32, 8, bigEndian) : elfValue(header + 28, 4, bigEndian);
+    phentsize = elfValue(header + (is64 ? 54 : 42), 2, bigEndian);
+    phnum     = elfValue(header + (is64 ? 56 : 44), 2, bigEndian);
+    if (phentsize < (is64 ? 56u : 32u))
+        return -1;
+
+    for (i = 0; i < phnum; ++i)
+    {
+        if (fseek(image->fp, phoff + i * phentsize, SEEK_SET) != 0)
+            return -1;
+        if (fread(phdr, 1, is64 ? 56 : 32, image->fp) < (is64 ? 56u : 32u))
+            return -1;
+        if (elfValue(phdr, 4, bigEndian) != ISP_ELF_PT_LOAD)
+            continue;
+        offset = is64 ? elfValue(phdr + 8, 8, bigEndian) : elfValue(phdr + 4, 4, bigEndian);
+        length = is64 ? elfValue(phdr + 32, 8, bigEndian) : elfValue(phdr + 16, 4, bigEndian);
+        /*Content behind the end of the file would be read as garbage, so the file is broken*/
+        if ((offset > fileSize) || (length > fileSize - offset))
+            return -1;
+        /*Use the physical address, as this is where the content has to go into the PROM/Flash*/
+        segment.fileOffset = offset;
+        segment.address    = is64 ? elfValue(phdr + 24, 8, bigEndian) : elfValue(phdr + 12, 4, bigEndian);
+        segment.length     = length;
+        segment.base = 0;
+        /*Skip segments without content in the file (e.g. .bss)*/
+        if (segment.length > 0)
+            image->segments.push_back(segment);
+    }
+    return 0;
+}
+
+/*Guesses the format from the first bytes of the file, unless the name says it is raw*/
+static enum ispImageFormat detectFormat(ispImage *image, const char *filename)
+{
+    uint8_t magic[4] = {0, 0, 0, 0};
+    size_t length = strlen(filename);
+
+    /*Raw content may start with anything, even with what looks like a magic*/
+    if ((length >= 4) && (strcasecmp(filename + length - 4, ".bin") == 0))
+        return ISP_IMAGE_BINARY;
+
+    fread(magic, 1, sizeof(magic), image->fp);
+    rewind(image->fp);
+    if (magic[0] == 0x7f && magic[1] == 'E' && magic[2] == 'L' && magic[3] == 'F')
+        return ISP_IMAGE_ELF;
+    if (magic[0] == ':')
+        return ISP_IMAGE_IHEX;
+    if (magic[0] == 'S' && isdigit(magic[1]))
+        return ISP_IMAGE_SREC;
+    /*Everything else is a plain binary*/
+    return ISP_IMAGE_BINARY;
+}
+
+int ispImageOpen(ispImage *image, const char *filename, const unsigned int binaryAddr, const enum ispImageFormat format)
+{
+    ispImageSegment segment;
+    int result = 0;
+
+    image->fp = fopen(filename, "rb");
+    if (!image->fp)
+        return -1;
+    image->segments.clear();
+    image->current = 0;
+    image->position = 0;
+    image->base = 0;
+    image->recordLength = 0;
+    image->recordPosition = 0;
+
+    image->format = (format == ISP_IMAGE_AUTO) ? detectFormat(image, filename) : format;
+    if (image->format == ISP_IMAGE_ELF)
+    {
+        result = scanElf(image);
+    } else if (image->format == ISP_IMAGE_IHEX || image->format == ISP_IMAGE_SREC) {
+        result = scanRecords(image);
+    } else {
+        image->format = ISP_IMAGE_BINARY;
+        fseek(image->fp, 0, SEEK_END);
+        segment.address = binaryAddr;
+        segment.length = ftell(image->fp);
+        segment.fileOffset = 0;
+        segment.base = 0;
+        image->segments.push_back(segment);
+    }
+
+    if (result != 0)
+    {
+        ispImageClose(image);
+        return -1;
+    }
+    return ispImageSelect(image, 0);
+}
+
+void ispImageClose(ispImage *image)
+{
+    if (image->fp)
+        fclose(image->fp);
+    image->fp = NULL;
+}
+
+int ispImageSelect(ispImage *image, const unsigned int segment)
+{
+    image->current = segment;
+    image->position = 0;
+    image->recordLength = 0;
+    image->recordPosition = 0;
+    if (segment >= image->segments.size())
+        return 0;
+    image->base = image->segments[segment].base;
+    return fseek(image->fp, image->segments[segment].fileOffset, SEEK_SET);
+}
+
+unsigned int ispImageRead(ispImage *image, void *buffer, const unsigned int length)
+{
+    uint8_t *dest = (uint8_t *)buffer;
+    unsigned int copied = 0;
+    unsigned int address, n;
+    int result;
+
+    if (image->current >= image->segments.size())
+        return 0;
+    const ispImageSegment &segment = image->segments[image->current];
+
+    /*Binary content can be read directly*/
+    if (image->format == ISP_IMAGE_BINARY || image->format == ISP_IMAGE_ELF)
+    {
+        n = segment.length - image->position;
+        if (n > length)
+            n = length;
+        n = fread(dest, 1, n, image->fp);
+        image->position += n;
+        return n;
+    }
+
+    /*Text records have to be decoded one after another*/
+    while ((copied < length) && (image->position < segment.length))
+    {
+        if (image->recordPosition >= image->recordLength)
+        {
+            result = nextRecord(image, &address);
+            if (result == ISP_RECORD_OTHER)
+                continue;
+            if (result != ISP_RECORD_DATA)
+                break;
+            image->recordPosition = 0;
+        }
+        n = image->recordLength - image->recordPosition;
+        if (n > length - copied)
+            n = length - copied;
+        if (n > segment.length - image->position)
+            n = segment.length - image->position;
+        memcpy(dest + copied, image->record + image->recordPosition, n);
+        image->recordPosition += n;
+        image->position += n;
+        copied += n;
+    }
+    return copied;
+}
+
+const char *ispImageFormatName(const enum ispImageFormat format)
+{
+    switch (format)
+    {
+        case ISP_IMAGE_IHEX:
+            return "Intel HEX";
+        case ISP_IMAGE_SREC:
+            return "S-record";
+        case ISP_IMAGE_ELF:
+            return "ELF";
+        default:
+            return "binary";
+    }
+}
+
+int ispImageParseFormat(const char *name, enum ispImageFormat *format)
+{
+    if (strcmp(name, "auto") == 0)
+        *format = ISP_IMAGE_AUTO;
+    else if (strcmp(name, "bin") == 0)
+        *format = ISP_IMAGE_BINARY;
+    else if (strcmp(name, "hex") == 0)
+        *format = ISP_IMAGE_IHEX;
+    else if (strcmp(name, "srec") == 0)
+        *format = ISP_IMAGE_SREC;
+    else if (strcmp(name, "elf") == 0)
+        *format = ISP_IMAGE_ELF;
+    else
+        return -1;
+    return 0;
+}
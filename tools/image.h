@@ -0,0 +1,86 @@
+#ifndef __ISP_IMAGE_H
+#define __ISP_IMAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Supported formats of firmware images
+ */
+enum ispImageFormat {
+    ISP_IMAGE_BINARY,
+    ISP_IMAGE_IHEX,
+    ISP_IMAGE_SREC,
+    ISP_IMAGE_ELF,
+    /*Detect the format when opening*/
+    ISP_IMAGE_AUTO
+};
+
+/**
+ * A contiguous region of an image. The content is not kept in memory,
+ * instead fileOffset points to the first record (or byte) describing it.
+ */
+typedef struct {
+    unsigned int address;
+    unsigned int length;
+    long fileOffset;
+    /*Extended address in effect at fileOffset (IHEX only)*/
+    unsigned int base;
+} ispImageSegment;
+
+/**
+ * An opened image file with its segment list and the state of the current read
+ */
+typedef struct {
+    FILE *fp;
+    enum ispImageFormat format;
+    std::vector<ispImageSegment> segments;
+    /*Streaming state*/
+    unsigned int current;
+    unsigned int position;
+    unsigned int base;
+    uint8_t record[256];
+    unsigned int recordLength;
+    unsigned int recordPosition;
+} ispImage;
+
+/**
+ * Opens an image and builds its segment list in a single pass over the file.
+ * With ISP_IMAGE_AUTO, files named *.bin are raw binaries and the format of all
+ * others is detected from the content; everything unknown is treated as raw binary.
+ * Raw binaries are located at binaryAddr.
+ * Returns 0 on success
+ */
+int ispImageOpen(ispImage *image, const char *filename, const unsigned int binaryAddr,
+        const enum ispImageFormat format);
+
+/**
+ * Closes the underlying file
+ */
+void ispImageClose(ispImage *image);
+
+/**
+ * Prepares streaming of the given segment from its beginning
+ * Returns 0 on success
+ */
+int ispImageSelect(ispImage *image, const unsigned int segment);
+
+/**
+ * Reads up to length bytes of the selected segment, decoding the records on the fly.
+ * Returns the number of bytes read
+ */
+unsigned int ispImageRead(ispImage *image, void *buffer, const unsigned int length);
+
+/**
+ * Returns a readable name of the image format
+ */
+const char *ispImageFormatName(const enum ispImageFormat format);
+
+/**
+ * Parses a format given by the user ("auto", "bin", "hex", "srec" or "elf")
+ * Returns 0 on success
+ */
+int ispImageParseFormat(const char *name, enum ispImageFormat *format);
+
+#endif
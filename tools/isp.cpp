@@ -3,11 +3,15 @@
 #include <unistd.h>
 #include <string.h>
 #include <getopt.h>
+#include <time.h>
 
 #include "ndlcom/Bridge.h"
 #include "ndlcom/Node.h"
 //#include "ndlcom/ExternalInterfaceParseUri.hpp"
 #include "isp/isp.h"
+#include "image.h"
+#include "daemon.h"
+#include "snapshot.h"
 
 static struct option long_options[] = {
     {"help",     no_argument,       0, 'h'},
@@ -20,11 +24,28 @@ static struct option long_options[] = {
     {"size",     required_argument, 0, 's'},
     {"uri",      required_argument, 0, 'i'},
     {"my_id",    required_argument, 0, 'm'},
+    {"rate",     required_argument, 0, 'r'},
+    {"burst",    required_argument, 0, 'b'},
+    {"window",   required_argument, 0, 'w'},
+    {"daemon",   required_argument, 0, 'D'},
+    {"snapshot", required_argument, 0, 'S'},
+    {"restore",  required_argument, 0, 'R'},
+    {"format",   required_argument, 0, 'F'},
+    {"timeout",  required_argument, 0, 't'},
     {0, 0, 0, 0}
 };
 
 static char filename[256];
 static char uri[256];
+static char socketPath[256];
+static char snapshotDir[256];
+static std::vector<NDLComId> nodeIds;
+static unsigned long rate = 0;
+static unsigned long burst = 0;
+static unsigned int window = 1;
+static enum ispImageFormat format = ISP_IMAGE_AUTO;
+static unsigned int timeoutMs = 10000;
+static bool timedOut = false;
 
 enum ispAction {
     ISP_ACTION_NONE,
@@ -32,13 +53,17 @@ enum ispAction {
     ISP_ACTION_FIRMWARE,
     ISP_ACTION_UPLOAD,
     ISP_ACTION_DOWNLOAD,
-    ISP_ACTION_VERIFY
+    ISP_ACTION_VERIFY,
+    ISP_ACTION_DAEMON,
+    ISP_ACTION_SNAPSHOT,
+    ISP_ACTION_RESTORE
 };
 
 /*C-type subclassing: ispMasterContext inherits from ispContext*/
 typedef struct {
     ispContext ctx;
     FILE *fp;
+    ispImage *image;
 } ispMasterContext;
 
 void ispMasterWrite (void *context, const void *buffer, const unsigned int length)
@@ -51,17 +76,57 @@ void ispMasterWrite (void *context, const void *buffer, const unsigned int lengt
 unsigned int ispMasterRead (void *context, void *buffer, const unsigned int length)
 {
     ispMasterContext *mctx = (ispMasterContext *)context;
-    int n = fread(buffer, 1, length, mctx->fp);
+    int n;
+    /*Images are decoded while streaming the selected segment*/
+    if (mctx->image)
+        return ispImageRead(mctx->image, buffer, length);
+    n = fread(buffer, 1, length, mctx->fp);
     return (n > 0 ? n : 0);
 }
 
-long fileSize(FILE *fp)
+unsigned long monotonicMicros (void)
 {
-    long value;
-    fseek(fp, 0, SEEK_END);
-    value = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    return value;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+ispState runTransfer(struct NDLComBridge *bridge, ispMasterContext *context)
+{
+    unsigned int percentage = 0;
+    unsigned int lastPercentage = 0;
+    ispState lastState = context->ctx.state;
+    unsigned int lastOffset = context->ctx.offset;
+    unsigned long lastProgress = monotonicMicros();
+
+    // Main loop for handling ndlcom packets
+    while (ispIsBusy(&context->ctx))
+    {
+        // Every percent we print a '.'
+        percentage = context->ctx.length ? context->ctx.offset * 100 / context->ctx.length : 0;
+        if (percentage != lastPercentage)
+        {
+            printf(".");
+            fflush(stdout);
+            lastPercentage = percentage;
+        }
+        ispProcess(&context->ctx);
+        ndlcomBridgeProcessOnce(bridge);
+        // Give up on devices which stopped answering, the abort frees them if they come back
+        if ((context->ctx.state != lastState) || (context->ctx.offset != lastOffset))
+        {
+            lastState = context->ctx.state;
+            lastOffset = context->ctx.offset;
+            lastProgress = monotonicMicros();
+        } else if ((timeoutMs > 0) && (context->ctx.state != ISP_STATE_ERROR) &&
+                   (monotonicMicros() - lastProgress >= timeoutMs * 1000UL)) {
+            fprintf(stderr, " No progress for %u ms at address 0x%x, aborting\n", timeoutMs,
+                    context->ctx.startAddr + context->ctx.offset);
+            ispMasterAbort(&context->ctx);
+            timedOut = true;
+        }
+    }
+    return context->ctx.state;
 }
 
 enum ispAction parse_args(ispMasterContext *context, int argc, char **argv);
@@ -71,11 +136,15 @@ int main(int argc, char **argv)
 {
     struct NDLComBridge bridge;
     struct NDLComNode node;
+    ispRateLimiter limiter;
+    ispPacketQueue pending;
     ispMasterContext context, tmp;
     enum ispAction action = ISP_ACTION_NONE;
-    unsigned int percentage = 0;
-    unsigned int lastPercentage = 0;;
-    unsigned int size;
+    ispImage image;
+    ispState state = ISP_STATE_IDLE;
+    unsigned int i;
+
+    memset(&tmp, 0, sizeof(tmp));
 
     if ((action = parse_args(&tmp, argc, argv)) == ISP_ACTION_NONE) return -1;
 
@@ -88,38 +157,57 @@ int main(int argc, char **argv)
 
     // Prepare ISP master and its context
     ispMasterCreate(&context.ctx, &node, ispMasterRead, ispMasterWrite);
+    context.fp = NULL;
+    context.image = NULL;
     // Insert stuff from parse_args
     ispMasterSetTarget(&context.ctx, tmp.ctx.targetId, tmp.ctx.startAddr, tmp.ctx.length);
+    // Pace our packets if requested. All contexts on this node should share the limiter.
+    if (rate > 0)
+    {
+        ispRateLimiterInit(&limiter, monotonicMicros, rate, burst);
+        ispSetRateLimiter(&context.ctx, &limiter, &pending);
+    }
+    // Send blocks ahead during uploads, the clock lets us resend lost ones
+#if ISP_WINDOW_SIZE > 1
+    ispMasterSetWindow(&context.ctx, window);
+    ispSetClock(&context.ctx, monotonicMicros);
+#else
+    if (window > 1)
+        fprintf(stderr, "Built without ISP_WINDOW_SIZE, uploading block by block\n");
+#endif
 
     // II. Prepare actions
     switch (action)
     {
+        case ISP_ACTION_DAEMON:
+            // Keep bridge and node open and serve jobs until we are stopped
+            ispDestroy(&context.ctx);
+            return ispDaemonRun(&bridge, &node, (rate > 0) ? &limiter : NULL, timeoutMs, socketPath);
+        case ISP_ACTION_SNAPSHOT:
+            // Back up all given nodes at once into a deduplicated store
+            ispDestroy(&context.ctx);
+            return ispSnapshotCreate(&bridge, &node, (rate > 0) ? &limiter : NULL, timeoutMs,
+                    snapshotDir, nodeIds, tmp.ctx.startAddr, tmp.ctx.length) ? -1 : 0;
+        case ISP_ACTION_RESTORE:
+            ispDestroy(&context.ctx);
+            return ispSnapshotRestore(&bridge, &node, (rate > 0) ? &limiter : NULL, timeoutMs,
+                    snapshotDir, nodeIds) ? -1 : 0;
         case ISP_ACTION_BOOTLOADER:
             printf("Switching to bootloader at device %u\n", context.ctx.targetId);
             ispMasterExecuteSlaveBootloader(&context.ctx);
-            ndlcomBridgeProcessOnce(&bridge);
+            do {
+                ispProcess(&context.ctx);
+                ndlcomBridgeProcessOnce(&bridge);
+            } while (ispIsBusy(&context.ctx));
             return 0;
         case ISP_ACTION_FIRMWARE:
             printf("Switching to firmware at device %u\n", context.ctx.targetId);
             ispMasterExecuteSlaveFirmware(&context.ctx);
-            ndlcomBridgeProcessOnce(&bridge);
+            do {
+                ispProcess(&context.ctx);
+                ndlcomBridgeProcessOnce(&bridge);
+            } while (ispIsBusy(&context.ctx));
             return 0;
-        case ISP_ACTION_UPLOAD:
-            printf("Uploading '%s' to device %u: ", filename, context.ctx.targetId);
-            // Open file for reading
-            context.fp = fopen(filename, "r");
-            if (!context.fp)
-            {
-                fprintf(stderr, "Could not open file '%s'\n", filename);
-                return -1;
-            }
-            // Check size
-            size = fileSize(context.fp);
-            if (context.ctx.length > size)
-                context.ctx.length = size;
-            // Start uploading
-            ispMasterStartUpload(&context.ctx);
-            break;
         case ISP_ACTION_DOWNLOAD:
             printf("Downloading to '%s' from device %u: ", filename, context.ctx.targetId);
             // Open file for writing
@@ -131,50 +219,59 @@ int main(int argc, char **argv)
             }
             // Send first download command
             ispMasterStartDownload(&context.ctx);
+            state = runTransfer(&bridge, &context);
+            fclose(context.fp);
             break;
+        case ISP_ACTION_UPLOAD:
         case ISP_ACTION_VERIFY:
         default:
-            printf("Verifiing '%s' and content at device %u: ", filename, context.ctx.targetId);
-            // Open file for reading
-            context.fp = fopen(filename, "r");
-            if (!context.fp)
+            // Open image and find its segments
+            if (ispImageOpen(&image, filename, tmp.ctx.startAddr, format) != 0)
             {
-                fprintf(stderr, "Could not open file '%s'\n", filename);
+                fprintf(stderr, "Could not open image '%s'\n", filename);
                 return -1;
             }
-            // Check size
-            size = fileSize(context.fp);
-            if (context.ctx.length > size)
-                context.ctx.length = size;
-            // Send first download command
-            ispMasterStartVerify(&context.ctx);
+            context.image = &image;
+            printf("%s '%s' (%s, %u segments) %s device %u\n",
+                    (action == ISP_ACTION_UPLOAD) ? "Uploading" : "Verifiing",
+                    filename, ispImageFormatName(image.format), (unsigned int)image.segments.size(),
+                    (action == ISP_ACTION_UPLOAD) ? "to" : "with", context.ctx.targetId);
+            // Transfer one segment after another, only real content goes over the bus
+            for (i = 0; (i < image.segments.size()) && (state == ISP_STATE_IDLE); ++i)
+            {
+                unsigned int length = image.segments[i].length;
+                // Check size (only meaningful for raw binaries)
+                if ((image.format == ISP_IMAGE_BINARY) && (tmp.ctx.length > 0) && (tmp.ctx.length < length))
+                    length = tmp.ctx.length;
+                printf("  0x%08x - 0x%08x: ", image.segments[i].address, image.segments[i].address + length);
+                ispImageSelect(&image, i);
+                ispMasterSetTarget(&context.ctx, tmp.ctx.targetId, image.segments[i].address, length);
+                if (action == ISP_ACTION_UPLOAD)
+                    ispMasterStartUpload(&context.ctx);
+                else
+                    ispMasterStartVerify(&context.ctx);
+                state = runTransfer(&bridge, &context);
+                if (state == ISP_STATE_IDLE)
+                    printf(" OK\n");
+            }
+            ispImageClose(&image);
             break;
     }
 
-    // III. Main loop for handling ndlcom packets
-    while (ispIsBusy(&context.ctx))
-    {
-        // Every percent we print a '.'
-        percentage = context.ctx.offset * 100 / context.ctx.length;
-        if (percentage != lastPercentage)
-        {
-            printf(".");
-            lastPercentage = percentage;
-        }
-        ndlcomBridgeProcessOnce(&bridge);
-    }
-
     // IV. Check if we have been successful
-    switch (context.ctx.state)
+    switch (state)
     {
         case ISP_STATE_IDLE:
             printf(" DONE\n");
             return 0;
         case ISP_STATE_ERROR:
+            // Already reported
+            if (timedOut)
+                break;
             switch (action)
             {
                 case ISP_ACTION_VERIFY:
-                    fprintf(stderr, " Verification failed at offset 0x%x\n", context.ctx.offset);
+                    fprintf(stderr, " Verification failed at address 0x%x\n", context.ctx.startAddr + context.ctx.offset);
                     break;
                 default:
                     fprintf(stderr, " In state error but dont know why ...\n");
@@ -238,7 +335,10 @@ enum ispAction parse_args(ispMasterContext *context, int argc, char **argv)
             break;
 
         case 'n':
+            // A comma separated list is used by snapshot and restore, the first id by everything else
             context->ctx.targetId = atoi(optarg);
+            for (char *id = strtok(optarg, ","); id; id = strtok(NULL, ","))
+                nodeIds.push_back(atoi(id));
             break;
 
         case 'a':
@@ -248,6 +348,45 @@ enum ispAction parse_args(ispMasterContext *context, int argc, char **argv)
         case 's':
             context->ctx.length = atoi(optarg);
             break;
+
+        case 'r':
+            rate = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'b':
+            burst = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'w':
+            window = atoi(optarg);
+            break;
+
+        case 'D':
+            action = ISP_ACTION_DAEMON;
+            snprintf(socketPath, 256, "%s", optarg);
+            break;
+
+        case 'S':
+            action = ISP_ACTION_SNAPSHOT;
+            snprintf(snapshotDir, 256, "%s", optarg);
+            break;
+
+        case 'R':
+            action = ISP_ACTION_RESTORE;
+            snprintf(snapshotDir, 256, "%s", optarg);
+            break;
+
+        case 't':
+            timeoutMs = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'F':
+            if (ispImageParseFormat(optarg, &format) != 0)
+            {
+                fprintf(stderr, "Unknown image format '%s'\n", optarg);
+                exit(-1);
+            }
+            break;
      
         default:
             break;
@@ -259,14 +398,15 @@ enum ispAction parse_args(ispMasterContext *context, int argc, char **argv)
     {
         strncpy(filename,argv[optind],256);
     }
-    else if ((action != ISP_ACTION_BOOTLOADER) && (action != ISP_ACTION_FIRMWARE))
+    else if ((action == ISP_ACTION_UPLOAD) || (action == ISP_ACTION_VERIFY) || (action == ISP_ACTION_DOWNLOAD) ||
+             (action == ISP_ACTION_NONE))
     {
         print_help(argv[0]);
         exit(-1);
     }
 
     // Check size
-    if ((context->ctx.length < 1) && (action == ISP_ACTION_DOWNLOAD))
+    if ((context->ctx.length < 1) && ((action == ISP_ACTION_DOWNLOAD) || (action == ISP_ACTION_SNAPSHOT)))
     {
         fprintf(stderr, "Size has to be greater than zero\n");
         exit(-1);
@@ -281,14 +421,22 @@ void print_help(const char* name)
     printf("Options:\n");
     printf("  --help            Display this information\n");
     printf("  --execute={bl|fw} Executes the BootLoader (bl) or the FirmWare (fw) (only some devices)\n");
-    printf("  --node_id=<id>    Node id of the device to program\n");
+    printf("  --node_id=<id>    Node id of the device to program (comma separated list for snapshot/restore)\n");
     printf("  --address=<addr>  address (hex) to write bin-file to (default 0x0)\n");
     printf("  --size=<size>     Size of the data to download (default 0)\n");
     printf("  --uri=<uri>       An URI to the interface for data transmission and reception\n");
     printf("  --my_id=<id>      An id to be used for ISP (default 0x01)\n");
-    printf("\nThe following commands need a binary file argument\n");
-    printf("  --upload          Upload a bin-file\n");
-    printf("  --verify          Verify a bin-file (default)\n");
+    printf("  --rate=<bytes/s>  Limit the bandwidth used for ISP packets (default unlimited)\n");
+    printf("  --burst=<bytes>   Bytes which may be sent at once when limited (default one packet)\n");
+    printf("  --window=<blocks> Blocks sent ahead during uploads if the device supports it (default 1)\n");
+    printf("  --daemon=<socket> Keep running and accept jobs on a unix domain socket (see tools/daemon.h)\n");
+    printf("  --timeout=<ms>    Give up on devices without progress for this long (default 10000, 0 never)\n");
+    printf("  --snapshot=<dir>  Back up --address/--size of all nodes into a deduplicated store (see tools/snapshot.h)\n");
+    printf("  --restore=<dir>   Upload the snapshots of all nodes from a store\n");
+    printf("\nThe following commands need a file argument\n");
+    printf("  --upload          Upload an image (bin, Intel HEX, S-record or ELF)\n");
+    printf("  --format=<fmt>    Image format: auto (default), bin, hex, srec or elf\n");
+    printf("  --verify          Verify an image (default)\n");
     printf("  --download        Download data and store it to a file (--size=<size> required)\n");
 }
 
@@ -0,0 +1,409 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+
+#include "snapshot.h"
+
+/*One chunk of a node's manifest*/
+typedef struct {
+    unsigned int address;
+    unsigned int length;
+    std::string name;
+} ispSnapshotEntry;
+
+/**
+ * Content addressed block store. Blocks are named by their FNV-1a hash;
+ * as this hash is not collision free, names of existing blocks are only
+ * reused if their content is equal.
+ */
+class ispSnapshotStore {
+public:
+    ispSnapshotStore() : stored(0), deduplicated(0) {}
+
+    int open(const char *directory)
+    {
+        dir = directory;
+        if ((mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) ||
+            (mkdir((dir + "/blocks").c_str(), 0755) != 0 && errno != EEXIST))
+        {
+            fprintf(stderr, "Could not create snapshot store '%s': %s\n", directory, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    std::string path(const std::string &name) const
+    {
+        return dir + "/blocks/" + name;
+    }
+
+    /*Stores a chunk (if not yet known) and returns its name, or an empty string on failure*/
+    std::string put(const uint8_t *data, const unsigned int length)
+    {
+        uint64_t hash = 14695981039346656037ULL;
+        char name[40];
+        unsigned int i, suffix;
+        int equal;
+        FILE *fp;
+
+        for (i = 0; i < length; ++i)
+        {
+            hash ^= data[i];
+            hash *= 1099511628211ULL;
+        }
+
+        for (suffix = 0; ; ++suffix)
+        {
+            if (suffix == 0)
+                snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+            else
+                snprintf(name, sizeof(name), "%016llx-%u", (unsigned long long)hash, suffix);
+            equal = compare(path(name), data, length);
+            if (equal > 0)
+            {
+                deduplicated++;
+                return name;
+            }
+            if (equal == 0)
+                continue;
+            /*Unknown block: write it under a temporary name first, so there are no partial blocks*/
+            fp = fopen((path(name) + ".tmp").c_str(), "wb");
+            if (!fp)
+                return "";
+            if (fwrite(data, 1, length, fp) != length)
+            {
+                fclose(fp);
+                return "";
+            }
+            fclose(fp);
+            if (rename((path(name) + ".tmp").c_str(), path(name).c_str()) != 0)
+                return "";
+            stored++;
+            return name;
+        }
+    }
+
+    std::string dir;
+    unsigned long stored;
+    unsigned long deduplicated;
+
+private:
+    /*Returns 1 if the block exists with equal content, 0 if it differs and -1 if it does not exist*/
+    static int compare(const std::string &filename, const uint8_t *data, const unsigned int length)
+    {
+        uint8_t buffer[ISP_SNAPSHOT_CHUNK_SIZE + 1];
+        FILE *fp = fopen(filename.c_str(), "rb");
+        size_t n;
+
+        if (!fp)
+            return -1;
+        n = fread(buffer, 1, sizeof(buffer), fp);
+        fclose(fp);
+        return (n == length && memcmp(buffer, data, length) == 0) ? 1 : 0;
+    }
+};
+
+/*State of the snapshot or restore of a single node, driven by its session*/
+class ispSnapshotTarget {
+public:
+    ispSnapshotTarget(isp::Executor &executor, struct NDLComNode &node, ispRateLimiter *limiter,
+            const unsigned int timeoutMs, const NDLComId id, ispSnapshotStore *s)
+        : session(executor, node, id, limiter), nodeId(id), store(s), failed(0), received(0),
+          fill(0), chunkAddr(0), manifest(NULL), runEnd(0), entry(0), block(NULL)
+    {
+        session.setTimeout(std::chrono::milliseconds(timeoutMs));
+    }
+
+    ~ispSnapshotTarget()
+    {
+        if (manifest)
+            fclose(manifest);
+        if (block)
+            fclose(block);
+    }
+
+    std::string manifestPath() const
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "/%u.manifest", nodeId);
+        return store->dir + name;
+    }
+
+    /*Snapshot: downloads addr..addr+size, the manifest is finalized as soon as the node is done*/
+    void startSnapshot(const unsigned int addr, const unsigned int size)
+    {
+        chunkAddr = addr;
+        manifest = fopen((manifestPath() + ".tmp").c_str(), "w");
+        if (!manifest)
+        {
+            fprintf(stderr, "\n  node %u: could not write '%s.tmp'", nodeId, manifestPath().c_str());
+            failed = 1;
+            return;
+        }
+        session.download(addr, size,
+                [this](const uint8_t *data, const unsigned int length) { write(data, length); },
+                [this](isp::Result result) { finishSnapshot(result); });
+    }
+
+    /*Restore: uploads one run of contiguous chunks after the other*/
+    int startRestore()
+    {
+        if (loadManifest() != 0)
+        {
+            fprintf(stderr, "\n  node %u: could not read '%s'", nodeId, manifestPath().c_str());
+            failed = 1;
+            return -1;
+        }
+        startNextRun();
+        return 0;
+    }
+
+    isp::Session session;
+    NDLComId nodeId;
+    ispSnapshotStore *store;
+    int failed;
+    unsigned long received;
+
+private:
+    /*Snapshot: put the collected chunk into the store and list it in the manifest*/
+    void flushChunk()
+    {
+        std::string name;
+
+        if (fill == 0)
+            return;
+        name = store->put(chunk, fill);
+        if (name.empty() || fprintf(manifest, "%08x %u %s\n", chunkAddr, fill, name.c_str()) < 0)
+            failed = 1;
+        chunkAddr += fill;
+        fill = 0;
+    }
+
+    void write(const uint8_t *bytes, const unsigned int length)
+    {
+        unsigned int n, done = 0;
+
+        received += length;
+        while (done < length)
+        {
+            n = std::min(length - done, ISP_SNAPSHOT_CHUNK_SIZE - fill);
+            memcpy(chunk + fill, bytes + done, n);
+            fill += n;
+            done += n;
+            if (fill == ISP_SNAPSHOT_CHUNK_SIZE)
+                flushChunk();
+        }
+    }
+
+    /*Only complete snapshots replace the manifest of a node*/
+    void finishSnapshot(const isp::Result &result)
+    {
+        if (!result.ok())
+            failed = 1;
+        if (!failed)
+            flushChunk();
+        if (fclose(manifest) != 0)
+            failed = 1;
+        manifest = NULL;
+        if (failed || rename((manifestPath() + ".tmp").c_str(), manifestPath().c_str()) != 0)
+        {
+            fprintf(stderr, "\n  node %u: FAILED at address 0x%x", nodeId, result.address);
+            remove((manifestPath() + ".tmp").c_str());
+            failed = 1;
+        }
+    }
+
+    int loadManifest()
+    {
+        FILE *fp = fopen(manifestPath().c_str(), "r");
+        char name[64];
+        ispSnapshotEntry e;
+
+        if (!fp)
+            return -1;
+        while (fscanf(fp, "%x %u %63s", &e.address, &e.length, name) == 3)
+        {
+            e.name = name;
+            entries.push_back(e);
+        }
+        fclose(fp);
+        return 0;
+    }
+
+    void startNextRun()
+    {
+        unsigned int length;
+        size_t runStart;
+
+        if (runEnd >= entries.size())
+            return;
+        runStart = runEnd;
+        length = entries[runStart].length;
+        for (runEnd = runStart + 1; runEnd < entries.size(); ++runEnd)
+        {
+            if (entries[runEnd].address != entries[runEnd - 1].address + entries[runEnd - 1].length)
+                break;
+            length += entries[runEnd].length;
+        }
+        entry = runStart;
+        if (block)
+            fclose(block);
+        block = NULL;
+        session.upload(entries[runStart].address, length,
+                [this](uint8_t *buffer, const unsigned int n) { return read(buffer, n); },
+                [this](isp::Result result) { finishRun(result); });
+    }
+
+    void finishRun(const isp::Result &result)
+    {
+        if (!result.ok())
+        {
+            fprintf(stderr, "\n  node %u: FAILED at address 0x%x", nodeId, result.address);
+            failed = 1;
+            return;
+        }
+        startNextRun();
+    }
+
+    /*Restore: streams the blocks of the current run one after another*/
+    unsigned int read(uint8_t *bytes, const unsigned int length)
+    {
+        unsigned int done = 0;
+        size_t n;
+
+        while (done < length && entry < runEnd)
+        {
+            if (!block)
+            {
+                block = fopen(store->path(entries[entry].name).c_str(), "rb");
+                if (!block)
+                    break;
+            }
+            n = fread(bytes + done, 1, length - done, block);
+            done += n;
+            if (n == 0)
+            {
+                /*Next block*/
+                fclose(block);
+                block = NULL;
+                entry++;
+            }
+        }
+        return done;
+    }
+
+    /*Snapshot*/
+    uint8_t chunk[ISP_SNAPSHOT_CHUNK_SIZE];
+    unsigned int fill;
+    unsigned int chunkAddr;
+    FILE *manifest;
+    /*Restore*/
+    std::vector<ispSnapshotEntry> entries;
+    size_t runEnd;
+    size_t entry;
+    FILE *block;
+};
+
+/*Drops duplicate ids, as one node can only take part once*/
+static std::vector<NDLComId> uniqueIds(const std::vector<NDLComId> &nodeIds)
+{
+    std::vector<NDLComId> ids(nodeIds);
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    return ids;
+}
+
+/*Sessions have to be destroyed before the executor they are attached to*/
+typedef std::vector<std::unique_ptr<ispSnapshotTarget> > ispSnapshotTargets;
+
+static int countFailed(const ispSnapshotTargets &targets)
+{
+    int errors = 0;
+    size_t i;
+
+    for (i = 0; i < targets.size(); ++i)
+        errors += targets[i]->failed;
+    return errors;
+}
+
+int ispSnapshotCreate(struct NDLComBridge *bridge, struct NDLComNode *node, ispRateLimiter *limiter,
+        const unsigned int timeoutMs, const char *dir, const std::vector<NDLComId> &nodeIds,
+        const unsigned int addr, const unsigned int size)
+{
+    ispSnapshotStore store;
+    std::vector<NDLComId> ids = uniqueIds(nodeIds);
+    isp::Executor executor(*bridge);
+    ispSnapshotTargets targets;
+    unsigned int percentage, lastPercentage = 0;
+    unsigned long transferred;
+    int errors;
+    size_t i;
+
+    if (store.open(dir) != 0)
+        return ids.size();
+
+    printf("Snapshot of 0x%08x - 0x%08x from %u nodes to '%s': ", addr, addr + size, (unsigned int)ids.size(), dir);
+    fflush(stdout);
+    // Start downloads from all nodes at once
+    for (i = 0; i < ids.size(); ++i)
+    {
+        targets.emplace_back(new ispSnapshotTarget(executor, *node, limiter, timeoutMs, ids[i], &store));
+        targets.back()->startSnapshot(addr, size);
+    }
+
+    // Every percent we print a '.'
+    while (executor.runOnce())
+    {
+        transferred = 0;
+        for (i = 0; i < targets.size(); ++i)
+            transferred += targets[i]->received;
+        percentage = (size && !ids.empty()) ? transferred * 100 / ((unsigned long)size * ids.size()) : 0;
+        if (percentage != lastPercentage)
+        {
+            printf(".");
+            fflush(stdout);
+            lastPercentage = percentage;
+        }
+    }
+    printf("\n");
+
+    errors = countFailed(targets);
+    targets.clear();
+    printf("%lu blocks stored, %lu deduplicated\n", store.stored, store.deduplicated);
+
+    return errors;
+}
+
+int ispSnapshotRestore(struct NDLComBridge *bridge, struct NDLComNode *node, ispRateLimiter *limiter,
+        const unsigned int timeoutMs, const char *dir, const std::vector<NDLComId> &nodeIds)
+{
+    ispSnapshotStore store;
+    std::vector<NDLComId> ids = uniqueIds(nodeIds);
+    isp::Executor executor(*bridge);
+    ispSnapshotTargets targets;
+    int errors;
+    size_t i;
+
+    store.dir = dir;
+    printf("Restoring %u nodes from '%s': ", (unsigned int)ids.size(), dir);
+    fflush(stdout);
+    // Start uploads to all nodes at once, every node proceeds with its next run when the last one is done
+    for (i = 0; i < ids.size(); ++i)
+    {
+        targets.emplace_back(new ispSnapshotTarget(executor, *node, limiter, timeoutMs, ids[i], &store));
+        targets.back()->startRestore();
+    }
+    executor.run();
+    printf("\n");
+
+    errors = countFailed(targets);
+    targets.clear();
+
+    return errors;
+}
@@ -0,0 +1,38 @@
+#ifndef __ISP_SNAPSHOT_H
+#define __ISP_SNAPSHOT_H
+
+#include <vector>
+
+#include "ndlcom/Bridge.h"
+#include "ndlcom/Node.h"
+#include "isp/isp.hpp"
+
+/**
+ * Snapshots are stored in a directory with a deduplicated block store:
+ *
+ *   <dir>/blocks/<hash>      content of one chunk, stored once for all nodes
+ *   <dir>/<node_id>.manifest one line "<address> <length> <hash>" per chunk
+ *
+ * Chunks are ISP_SNAPSHOT_CHUNK_SIZE bytes, aligned to the start address, so
+ * identical firmware on different nodes maps to the same blocks.
+ */
+#define ISP_SNAPSHOT_CHUNK_SIZE 4096
+
+/**
+ * Downloads addr..addr+size from all given nodes in parallel into the store at dir.
+ * The manifest of a node is written as soon as its download is complete; nodes
+ * making no progress for timeoutMs are given up (zero waits forever).
+ * Returns the number of nodes which could not be backed up.
+ */
+int ispSnapshotCreate(struct NDLComBridge *bridge, struct NDLComNode *node, ispRateLimiter *limiter,
+        const unsigned int timeoutMs, const char *dir, const std::vector<NDLComId> &nodeIds, const unsigned int addr, const unsigned int size);
+
+/**
+ * Uploads the snapshots of all given nodes in parallel from the store at dir.
+ * Nodes making no progress for timeoutMs are given up (zero waits forever).
+ * Returns the number of nodes which could not be restored.
+ */
+int ispSnapshotRestore(struct NDLComBridge *bridge, struct NDLComNode *node, ispRateLimiter *limiter,
+        const unsigned int timeoutMs, const char *dir, const std::vector<NDLComId> &nodeIds);
+
+#endif